@@ -0,0 +1,14 @@
+QT -= gui
+CONFIG += console c++17
+CONFIG -= app_bundle
+
+# Always measure an optimized build.
+CONFIG -= debug
+CONFIG += release
+
+INCLUDEPATH += $$PWD/..
+
+SOURCES += \
+        main.cpp
+
+include(../MessageCenter/MessageCenter.pri)
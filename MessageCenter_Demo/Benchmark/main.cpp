@@ -0,0 +1,474 @@
+// MessageCenter benchmark. Prints one JSON document with a result per
+// scenario and parameter set, so runs on two commits can be diffed.
+//
+//   Benchmark [--quick] [--only <scenario>] [--out <file>]
+//
+// Scenarios: fanout, copy, types, threads, churn, reentrant.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <QCoreApplication>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include "MessageCenter/MessageCenter.h"
+
+using namespace lilaomo;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// Size bytes of payload. Every run uses a Tag of its own so tombstones and
+// dispatch lists left behind by one run never slow down the next.
+template<size_t Size, size_t Tag>
+struct BenchMessage : Message {
+    std::array<char, Size> payload {};
+};
+
+// Handlers fold the payload in here so the work can't be optimized away.
+thread_local uint64_t t_sink = 0;
+
+template<typename MsgType>
+void Consume(const MsgType& msg) {
+    t_sink += static_cast<unsigned char>(msg.payload[0] + msg.payload[sizeof(msg.payload) - 1]);
+}
+
+int64_t Elapsed(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+// Reusable spin barrier; threads stay hot between the passes of a run.
+class Barrier {
+public:
+    explicit Barrier(size_t count)
+        : count_(count)
+    {
+
+    }
+
+    void Wait() {
+        const size_t phase = phase_.load(std::memory_order_acquire);
+        if (arrived_.fetch_add(1, std::memory_order_acq_rel) + 1 == count_) {
+            arrived_.store(0, std::memory_order_relaxed);
+            phase_.fetch_add(1, std::memory_order_release);
+            return;
+        }
+        while (phase_.load(std::memory_order_acquire) == phase)
+            std::this_thread::yield();
+    }
+
+private:
+    const size_t count_;
+    std::atomic<size_t> arrived_ { 0 };
+    std::atomic<size_t> phase_ { 0 };
+};
+
+struct Measurement {
+    size_t publishes = 0;           // both passes
+    size_t pass = 0;                // publishes per pass
+    int64_t wall = 0;               // ns, untimed pass
+    std::vector<int64_t> samples;   // ns per publish, timed pass
+};
+
+// Each of threads publishers calls publish(thread, i) count times, twice:
+// once untimed for throughput, then once timing every call for the
+// latency distribution, so clock reads don't skew the throughput.
+template<typename Publish>
+Measurement Measure(size_t threads, size_t count, Publish&& publish) {
+    Barrier barrier(threads);
+    std::vector<Clock::time_point> starts(threads);
+    std::vector<Clock::time_point> ends(threads);
+    std::vector<std::vector<int64_t>> samples(threads);
+    std::vector<std::thread> publishers;
+    for (size_t t = 0; t < threads; ++t) {
+        publishers.emplace_back([&, t]() {
+            samples[t].reserve(count);
+            barrier.Wait();
+            starts[t] = Clock::now();
+            for (size_t i = 0; i < count; ++i)
+                publish(t, i);
+            ends[t] = Clock::now();
+
+            barrier.Wait();
+            for (size_t i = 0; i < count; ++i) {
+                const Clock::time_point start = Clock::now();
+                publish(t, i);
+                samples[t].push_back(Elapsed(start));
+            }
+        });
+    }
+    for (std::thread& publisher : publishers)
+        publisher.join();
+
+    Measurement measurement;
+    measurement.pass = threads * count;
+    measurement.publishes = 2 * measurement.pass;
+    measurement.wall = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                *std::max_element(ends.begin(), ends.end()) - *std::min_element(starts.begin(), starts.end())).count();
+    for (std::vector<int64_t>& thread : samples)
+        measurement.samples.insert(measurement.samples.end(), thread.begin(), thread.end());
+    return measurement;
+}
+
+class Report {
+public:
+    bool quick = false;
+    const char* only = nullptr;
+
+    bool Enabled(const char* scenario) const {
+        return !only || std::strcmp(only, scenario) == 0;
+    }
+
+    size_t Iterations(size_t full) const {
+        return quick ? std::max<size_t>(full / 20, 100) : full;
+    }
+
+    void Add(QJsonObject result, Measurement&& measurement) {
+        std::vector<int64_t>& samples = measurement.samples;
+        std::sort(samples.begin(), samples.end());
+        auto percentile = [&samples](double q) {
+            if (samples.empty())
+                return qint64(0);
+            return qint64(samples[std::min(samples.size() - 1, size_t(q * samples.size()))]);
+        };
+        int64_t total = 0;
+        for (int64_t sample : samples)
+            total += sample;
+
+        result["publishes"] = qint64(measurement.publishes);
+        result["publishes_per_pass"] = qint64(measurement.pass);
+        result["throughput"] = measurement.wall > 0 ? measurement.pass * 1e9 / measurement.wall : 0.0;
+        result["latency_ns"] = QJsonObject {
+            { "mean", samples.empty() ? 0.0 : double(total) / samples.size() },
+            { "p50", percentile(0.50) },
+            { "p90", percentile(0.90) },
+            { "p99", percentile(0.99) },
+            { "p999", percentile(0.999) },
+            { "max", samples.empty() ? qint64(0) : qint64(samples.back()) }
+        };
+        std::fprintf(stderr, "%s: %.0f msg/s, p50 %lld ns, p99 %lld ns\n",
+                     qPrintable(result["scenario"].toString()),
+                     result["throughput"].toDouble(),
+                     static_cast<long long>(percentile(0.50)),
+                     static_cast<long long>(percentile(0.99)));
+        results_.append(result);
+    }
+
+    QJsonDocument Document() const {
+        return QJsonDocument(QJsonObject {
+            { "benchmark", "MessageCenter" },
+            { "quick", quick },
+            { "hardware_concurrency", qint64(std::thread::hardware_concurrency()) },
+            { "results", results_ }
+        });
+    }
+
+private:
+    QJsonArray results_;
+};
+
+void Cancel(std::vector<Subscription>& subscriptions) {
+    for (Subscription& subscription : subscriptions)
+        subscription.Cancel();
+    subscriptions.clear();
+}
+
+
+
+// One publisher, a growing number of const& subscribers: the dispatch
+// walk itself.
+template<size_t Size, size_t Tag>
+void FanoutRun(Report& report, size_t subscribers) {
+    using Msg = BenchMessage<Size, Tag>;
+    std::vector<Subscription> subscriptions;
+    for (size_t i = 0; i < subscribers; ++i)
+        subscriptions.push_back(LLMMSG->Subscribe<Msg>([](const Msg& msg) { Consume(msg); }));
+
+    Msg msg;
+    report.Add(QJsonObject {
+        { "scenario", "fanout" },
+        { "subscribers", qint64(subscribers) },
+        { "size", qint64(Size) }
+    }, Measure(1, report.Iterations(200000), [&msg](size_t, size_t) {
+        LLMMSG->Publish(msg);
+    }));
+    Cancel(subscriptions);
+}
+
+template<size_t Size, size_t Tag>
+void Fanout(Report& report) {
+    FanoutRun<Size, Tag + 0>(report, 1);
+    FanoutRun<Size, Tag + 1>(report, 8);
+    FanoutRun<Size, Tag + 2>(report, 64);
+}
+
+
+
+template<typename MsgType>
+class CopySink {
+public:
+    void Receive(MsgType msg) {
+        Consume(msg);
+    }
+};
+
+// By-value member subscribers: an lvalue publish copies for each of them,
+// an rvalue one moves into the last.
+template<size_t Size, size_t Tag, bool Rvalue>
+void CopyRun(Report& report) {
+    using Msg = BenchMessage<Size, Tag>;
+    std::vector<Subscription> subscriptions;
+    CopySink<Msg> sinks[4];
+    for (CopySink<Msg>& sink : sinks)
+        subscriptions.push_back(LLMMSG->Subscribe(&CopySink<Msg>::Receive, &sink));
+
+    report.Add(QJsonObject {
+        { "scenario", "copy" },
+        { "subscribers", 4 },
+        { "size", qint64(Size) },
+        { "rvalue", Rvalue }
+    }, Measure(1, report.Iterations(100000), [](size_t, size_t) {
+        Msg msg;
+        if constexpr (Rvalue)
+            LLMMSG->Publish(std::move(msg));
+        else
+            LLMMSG->Publish(msg);
+    }));
+    Cancel(subscriptions);
+}
+
+template<size_t Size, size_t Tag>
+void Copy(Report& report) {
+    CopyRun<Size, Tag + 0, false>(report);
+    CopyRun<Size, Tag + 1, true>(report);
+}
+
+
+
+// Many message types published round robin: the type table lookup and
+// how well the records stay in cache.
+template<size_t Tag>
+void PublishOne() {
+    BenchMessage<64, Tag> msg;
+    LLMMSG->Publish(msg);
+}
+
+template<size_t Tag>
+void SubscribeOne(std::vector<Subscription>& subscriptions) {
+    using Msg = BenchMessage<64, Tag>;
+    for (size_t i = 0; i < 4; ++i)
+        subscriptions.push_back(LLMMSG->Subscribe<Msg>([](const Msg& msg) { Consume(msg); }));
+}
+
+template<size_t Tag, size_t... I>
+void TypesRun(Report& report, std::index_sequence<I...>) {
+    constexpr size_t count = sizeof...(I);
+    std::vector<Subscription> subscriptions;
+    (SubscribeOne<Tag + I>(subscriptions), ...);
+    static constexpr std::array<void (*)(), count> publish { &PublishOne<Tag + I>... };
+
+    report.Add(QJsonObject {
+        { "scenario", "types" },
+        { "types", qint64(count) },
+        { "subscribers", 4 },
+        { "size", 64 }
+    }, Measure(1, report.Iterations(200000), [](size_t, size_t i) {
+        publish[i % count]();
+    }));
+    Cancel(subscriptions);
+}
+
+void Types(Report& report) {
+    TypesRun<1000>(report, std::make_index_sequence<1>());
+    TypesRun<1100>(report, std::make_index_sequence<16>());
+    TypesRun<1200>(report, std::make_index_sequence<128>());
+}
+
+
+
+// Publishers on several threads hitting the same type. The snapshot is
+// read without locks or reference counts; what the threads still share
+// is the reference count that pins the type's record while its handlers
+// run, and, for a sequenced type, the global sequence counter.
+template<size_t Tag, bool Sequenced = false>
+void ThreadsRun(Report& report, size_t threads) {
+    using Msg = BenchMessage<64, Tag>;
+    LLMMSG->SetSequenced<Msg>(Sequenced);
+    std::vector<Subscription> subscriptions;
+    for (size_t i = 0; i < 8; ++i)
+        subscriptions.push_back(LLMMSG->Subscribe<Msg>([](const Msg& msg) { Consume(msg); }));
+
+    report.Add(QJsonObject {
+        { "scenario", "threads" },
+        { "threads", qint64(threads) },
+        { "subscribers", 8 },
+        { "size", 64 },
+        { "sequenced", Sequenced }
+    }, Measure(threads, report.Iterations(100000), [](size_t, size_t) {
+        Msg msg;
+        LLMMSG->Publish(msg);
+    }));
+    Cancel(subscriptions);
+}
+
+void Threads(Report& report) {
+    ThreadsRun<2000>(report, 1);
+    ThreadsRun<2001>(report, 2);
+    ThreadsRun<2002>(report, 4);
+    ThreadsRun<2003>(report, 8);
+    ThreadsRun<2010, true>(report, 1);
+    ThreadsRun<2013, true>(report, 8);
+}
+
+
+
+// Publishing while another thread keeps subscribing and cancelling, so
+// every publish races with copy-and-swap updates of the same record.
+template<size_t Tag>
+void ChurnRun(Report& report, size_t threads) {
+    using Msg = BenchMessage<64, Tag>;
+    std::vector<Subscription> subscriptions;
+    for (size_t i = 0; i < 8; ++i)
+        subscriptions.push_back(LLMMSG->Subscribe<Msg>([](const Msg& msg) { Consume(msg); }));
+
+    std::atomic<bool> stop { false };
+    std::atomic<uint64_t> churned { 0 };
+    std::thread churn([&stop, &churned]() {
+        while (!stop.load(std::memory_order_relaxed)) {
+            Subscription subscription = LLMMSG->Subscribe<Msg>([](const Msg& msg) { Consume(msg); });
+            subscription.Cancel();
+            churned.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+
+    const Clock::time_point start = Clock::now();
+    Measurement measurement = Measure(threads, report.Iterations(100000), [](size_t, size_t) {
+        Msg msg;
+        LLMMSG->Publish(msg);
+    });
+    stop.store(true, std::memory_order_relaxed);
+    churn.join();
+    const int64_t wall = Elapsed(start);
+
+    report.Add(QJsonObject {
+        { "scenario", "churn" },
+        { "threads", qint64(threads) },
+        { "subscribers", 8 },
+        { "size", 64 },
+        { "churn_per_second", wall > 0 ? churned.load() * 1e9 / wall : 0.0 }
+    }, std::move(measurement));
+    Cancel(subscriptions);
+}
+
+void Churn(Report& report) {
+    ChurnRun<3000>(report, 1);
+    ChurnRun<3001>(report, 4);
+}
+
+
+
+// Each handler publishes the next level of a chain from inside dispatch,
+// Depth levels deep; the latency is that of the outermost publish.
+template<size_t Tag, size_t Level, size_t Depth>
+void Chain(std::vector<Subscription>& subscriptions) {
+    using Msg = BenchMessage<16, Tag + Level>;
+    subscriptions.push_back(LLMMSG->Subscribe<Msg>([](const Msg& msg) {
+        Consume(msg);
+        if constexpr (Level + 1 < Depth) {
+            BenchMessage<16, Tag + Level + 1> next;
+            LLMMSG->Publish(next);
+        }
+    }));
+    if constexpr (Level + 1 < Depth)
+        Chain<Tag, Level + 1, Depth>(subscriptions);
+}
+
+template<size_t Tag, size_t Depth>
+void ReentrantRun(Report& report) {
+    std::vector<Subscription> subscriptions;
+    Chain<Tag, 0, Depth>(subscriptions);
+
+    report.Add(QJsonObject {
+        { "scenario", "reentrant" },
+        { "depth", qint64(Depth) },
+        { "size", 16 }
+    }, Measure(1, report.Iterations(200000), [](size_t, size_t) {
+        BenchMessage<16, Tag> msg;
+        LLMMSG->Publish(msg);
+    }));
+    Cancel(subscriptions);
+}
+
+void Reentrant(Report& report) {
+    ReentrantRun<4000, 1>(report);
+    ReentrantRun<4010, 2>(report);
+    ReentrantRun<4020, 4>(report);
+    ReentrantRun<4030, 8>(report);
+}
+
+}
+
+
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    Report report;
+    const char* out = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--quick") == 0) {
+            report.quick = true;
+        } else if (std::strcmp(argv[i], "--only") == 0 && i + 1 < argc) {
+            report.only = argv[++i];
+        } else if (std::strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out = argv[++i];
+        } else {
+            std::fprintf(stderr, "usage: %s [--quick] [--only <scenario>] [--out <file>]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (report.Enabled("fanout")) {
+        Fanout<16, 100>(report);
+        Fanout<256, 110>(report);
+        Fanout<4096, 120>(report);
+    }
+    if (report.Enabled("copy")) {
+        Copy<16, 200>(report);
+        Copy<256, 210>(report);
+        Copy<4096, 220>(report);
+    }
+    if (report.Enabled("types"))
+        Types(report);
+    if (report.Enabled("threads"))
+        Threads(report);
+    if (report.Enabled("churn"))
+        Churn(report);
+    if (report.Enabled("reentrant"))
+        Reentrant(report);
+
+    QFile file;
+    bool opened = false;
+    if (out) {
+        file.setFileName(QString::fromLocal8Bit(out));
+        opened = file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+    } else {
+        opened = file.open(stdout, QIODevice::WriteOnly);
+    }
+    if (!opened) {
+        std::fprintf(stderr, "cannot write %s\n", out ? out : "stdout");
+        return 1;
+    }
+    file.write(report.Document().toJson(QJsonDocument::Indented));
+    return 0;
+}
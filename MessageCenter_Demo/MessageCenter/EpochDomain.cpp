@@ -0,0 +1,145 @@
+#include <limits>
+
+#include "EpochDomain.h"
+
+namespace lilaomo {
+
+namespace {
+
+constexpr uint32_t kCollectEvery = 64;
+
+// Hands the thread's slot back when the thread ends.
+struct LocalSlot {
+    ~LocalSlot() {
+        if (slot)
+            slot->store(false, std::memory_order_release);
+    }
+
+    std::atomic<bool>* slot = nullptr;
+};
+
+thread_local uint32_t t_retired = 0;
+
+}
+
+
+
+EpochDomain& EpochDomain::Instance() {
+    static EpochDomain* domain = new EpochDomain();
+    return *domain;
+}
+
+
+
+void EpochDomain::Retire(void* ptr, void (*destroy)(void*)) {
+    // The object is already unlinked, so a reader that announces the new
+    // epoch can't reach it any more.
+    const uint64_t epoch = epoch_.fetch_add(1, std::memory_order_seq_cst) + 1;
+    auto retired = new Retired { nullptr, epoch, ptr, destroy };
+    Push(retired, retired);
+
+    if (++t_retired % kCollectEvery == 0)
+        Collect();
+}
+
+
+
+// Whoever takes the list owns it; what is still visible goes back.
+void EpochDomain::Collect() {
+    Retired* list = retired_.exchange(nullptr, std::memory_order_acquire);
+    if (!list)
+        return;
+
+    const uint64_t oldest = Oldest();
+    Retired* keep = nullptr;
+    Retired* tail = nullptr;
+    while (list) {
+        Retired* next = list->next;
+        if (list->epoch <= oldest) {
+            list->destroy(list->ptr);
+            delete list;
+        } else {
+            list->next = keep;
+            keep = list;
+            if (!tail)
+                tail = list;
+        }
+        list = next;
+    }
+    if (keep)
+        Push(keep, tail);
+}
+
+
+
+EpochDomain::Slot* EpochDomain::Local() {
+    thread_local LocalSlot local;
+    thread_local Slot* slot = nullptr;
+    if (!slot) {
+        slot = Acquire();
+        local.slot = &slot->used;
+    }
+    return slot;
+}
+
+
+
+// Slots of finished threads are reused; the list only ever grows to the
+// most threads that have read at once.
+EpochDomain::Slot* EpochDomain::Acquire() {
+    for (Slot* slot = slots_.load(std::memory_order_acquire); slot; slot = slot->next) {
+        bool used = false;
+        if (!slot->used.load(std::memory_order_relaxed)
+                && slot->used.compare_exchange_strong(used, true, std::memory_order_acquire))
+            return slot;
+    }
+
+    auto slot = new Slot();
+    slot->used.store(true, std::memory_order_relaxed);
+    Slot* head = slots_.load(std::memory_order_relaxed);
+    do {
+        slot->next = head;
+    } while (!slots_.compare_exchange_weak(head, slot, std::memory_order_release, std::memory_order_relaxed));
+    return slot;
+}
+
+
+
+uint64_t EpochDomain::Oldest() const {
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    for (Slot* slot = slots_.load(std::memory_order_acquire); slot; slot = slot->next) {
+        const uint64_t epoch = slot->epoch.load(std::memory_order_seq_cst);
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+    return oldest;
+}
+
+
+
+void EpochDomain::Push(Retired* first, Retired* last) {
+    Retired* head = retired_.load(std::memory_order_relaxed);
+    do {
+        last->next = head;
+    } while (!retired_.compare_exchange_weak(head, first, std::memory_order_release, std::memory_order_relaxed));
+}
+
+
+
+// Announcing with seq_cst orders it before the pointer loads that follow:
+// a writer whose scan misses the announcement has swapped before them.
+EpochGuard::EpochGuard()
+    : slot_(EpochDomain::Instance().Local())
+{
+    if (slot_->depth++ == 0)
+        slot_->epoch.store(EpochDomain::Instance().epoch_.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+}
+
+
+
+EpochGuard::~EpochGuard() {
+    if (--slot_->depth == 0)
+        slot_->epoch.store(0, std::memory_order_release);
+}
+
+}
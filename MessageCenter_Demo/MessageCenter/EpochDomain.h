@@ -0,0 +1,114 @@
+#ifndef EPOCHDOMAIN_H
+#define EPOCHDOMAIN_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace lilaomo {
+
+// Epoch-based reclamation for data readers reach through a plain atomic
+// pointer. A reader announces the epoch it started in, in a slot of its
+// own thread, for as long as an EpochGuard lives; an object retired by a
+// writer is destroyed only once every reader that could still see it has
+// left. Readers take no lock and touch no shared reference count.
+class EpochDomain {
+public:
+    // Never destroyed, so that guards and retirements stay valid at exit.
+    static EpochDomain& Instance();
+
+    // Destroys ptr once no reader that may hold it is left. The object
+    // must already be unreachable for new readers.
+    void Retire(void* ptr, void (*destroy)(void*));
+
+    template<typename T>
+    void Retire(T* ptr) {
+        Retire(const_cast<void*>(static_cast<const void*>(ptr)), [](void* p) {
+            delete static_cast<T*>(p);
+        });
+    }
+
+    // Destroys whatever no active reader can see any more. Retire calls it
+    // now and then; writers call it after a swap to reclaim promptly.
+    void Collect();
+
+private:
+    friend class EpochGuard;
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch { 0 };     // 0 while the thread reads nothing
+        std::atomic<bool> used { false };
+        size_t depth = 0;                       // nested guards, owner thread only
+        Slot* next = nullptr;
+    };
+
+    struct Retired {
+        Retired* next;
+        uint64_t epoch;
+        void* ptr;
+        void (*destroy)(void*);
+    };
+
+    EpochDomain() = default;
+
+    Slot* Local();
+    Slot* Acquire();
+    uint64_t Oldest() const;
+    void Push(Retired* first, Retired* last);
+
+private:
+    std::atomic<uint64_t> epoch_ { 1 };
+    std::atomic<Slot*> slots_ { nullptr };
+    std::atomic<Retired*> retired_ { nullptr };
+};
+
+// Marks the calling thread as reading for its lifetime. Guards nest; only
+// the outermost one announces and withdraws the epoch.
+class EpochGuard {
+public:
+    EpochGuard();
+    ~EpochGuard();
+
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+
+private:
+    EpochDomain::Slot* slot_;
+};
+
+// Owning atomic pointer whose replaced values are retired, not deleted.
+template<typename T>
+class EpochPointer {
+public:
+    explicit EpochPointer(T* value = nullptr)
+        : ptr_(value)
+    {
+
+    }
+
+    ~EpochPointer() {
+        delete ptr_.load(std::memory_order_relaxed);
+    }
+
+    EpochPointer(const EpochPointer&) = delete;
+    EpochPointer& operator=(const EpochPointer&) = delete;
+
+    // Under an EpochGuard, or by the writer; the value stays valid until
+    // the guard goes.
+    T* Load() const {
+        return ptr_.load(std::memory_order_seq_cst);
+    }
+
+    void Store(T* value) {
+        T* old = ptr_.exchange(value, std::memory_order_seq_cst);
+        if (old)
+            EpochDomain::Instance().Retire(old);
+    }
+
+private:
+    std::atomic<T*> ptr_;
+};
+
+}
+
+#endif // EPOCHDOMAIN_H
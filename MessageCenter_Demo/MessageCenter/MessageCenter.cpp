@@ -1,82 +1,1398 @@
-#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
 #include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QEvent>
+#include <QThread>
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
 
+#include "EpochDomain.h"
 #include "MessageCenter.h"
+#include "WorkStealingPool.h"
 
 namespace lilaomo {
 
+namespace {
+
+struct TypeNames {
+    std::mutex mtx;
+    std::vector<const char*> names;
+};
+
+TypeNames& Names() {
+    static TypeNames names;
+    return names;
+}
+
+}
+
+size_t NextMessageTypeId(const char* name) {
+    TypeNames& names = Names();
+    std::unique_lock<std::mutex> ulock(names.mtx);
+    names.names.push_back(name);
+    return names.names.size() - 1;
+}
+
+
+
+QString MessageTypeName(size_t type) {
+    const char* name = nullptr;
+    {
+        TypeNames& names = Names();
+        std::unique_lock<std::mutex> ulock(names.mtx);
+        if (type < names.names.size())
+            name = names.names[type];
+    }
+    if (!name)
+        return QString();
+
+#ifdef __GNUG__
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (status == 0 && demangled) {
+        QString result = QString::fromUtf8(demangled);
+        std::free(demangled);
+        return result;
+    }
+#endif
+    return QString::fromUtf8(name);
+}
+
+
+
+// Counters are split into shards picked per thread, each on its own cache
+// line, so threads counting at the same time don't share a write.
+constexpr size_t kMetricShards = 8;
+
+static size_t MetricShard() {
+    static std::atomic<size_t> next { 0 };
+    thread_local const size_t shard = next.fetch_add(1, std::memory_order_relaxed) % kMetricShards;
+    return shard;
+}
+
+struct HandlerCounters {
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> calls { 0 };
+        std::atomic<uint64_t> slow { 0 };
+        std::atomic<int64_t> total { 0 };
+        std::atomic<int64_t> max { 0 };
+        std::atomic<uint64_t> histogram[kLatencyBuckets] {};
+    };
+    Shard shards[kMetricShards];
+};
+
+
+
+// Mutable per-subscription state; the subscriber lists themselves are
+// immutable snapshots.
+class SubscriptionState {
+public:
+    size_t type = 0;
+    std::shared_ptr<const QString> name;    // the type record's
+    std::atomic<bool> alive { true };
+    QMetaObject::Connection destroyed;
+
+    // A base-type subscription can have any derived type pending, so the
+    // value carries its own type and cast.
+    std::mutex mtx;
+    std::shared_ptr<const void> pending;
+    size_t pending_type = 0;
+    Upcast pending_upcast = nullptr;
+    int64_t pending_deadline = 0;
+    uint64_t pending_sequence = 0;          // 0 unless the type is sticky
+    bool pending_replay = false;
+
+    // While a replay is under way, the newest live sequence per sticky type
+    // the handler was given, so that an older replayed value is skipped.
+    // replaying counts the replay itself and its values not yet run.
+    std::atomic<size_t> replaying { 0 };
+    std::vector<std::pair<size_t, uint64_t>> seen;     // guarded by mtx
+
+    // Made the first time the handler runs with instrumentation on.
+    std::atomic<HandlerCounters*> metrics { nullptr };
+
+    ~SubscriptionState() {
+        delete metrics.load(std::memory_order_acquire);
+    }
+};
+
+
+
 class MessageCenter::MessageCenterImpl {
 public:
     struct SubscriberInfo;
+    struct TypeRecord;
+    class ThreadQueue;
 
-    using Callback = std::function<void(const std::any&)>;
-    using Subscribers = std::deque<SubscriberInfo>;
-    using SubscType = std::map<std::type_index, Subscribers>;
+    using Subscribers = std::vector<SubscriberInfo>;
+    using TypeRecordPtr = std::shared_ptr<const TypeRecord>;
+    using SubscType = std::vector<TypeRecordPtr>;
+    using QueueMap = std::unordered_map<QThread*, std::shared_ptr<ThreadQueue>>;
 
-    struct SubscriberInfo {
-        void* receiver;
-        uint64_t func;
-        Callback cb;
+    struct SubscriberInfo : Subscriber {
+        std::shared_ptr<SubscriptionState> state;
     };
 
-    void Distribute(const std::type_index& type, std::any&& msg) {
-        std::unique_lock<std::mutex> ulock(mtx_);
-        auto iter = subsc_.find(type);
-        if (iter == subsc_.end())
-            return;
+    // A subscriber of the type itself or of one of its bases, with the cast
+    // from the published type to the one it subscribed to.
+    struct Handler {
+        SubscriberInfo info;
+        Upcast upcast;
+
+        void* Cast(void* msg) const {
+            return upcast ? upcast(msg) : msg;
+        }
+    };
+
+    // Keyed handlers contributed by one type of the lineage, bucketed by
+    // key hash so a publish only visits the ones that can match.
+    struct RouteGroup {
+        Router router;
+        Upcast upcast;
+        std::unordered_map<size_t, std::vector<Handler>> index;
+    };
+
+    // One Distribute call in flight.
+    struct Publication {
+        Publication(const TypeRecordPtr& record, void* msg, Copier copier, Completion completion)
+            : record(record)
+            , msg(msg)
+            , copier(copier)
+            , completion(completion)
+        {
+            Upcast upcast = record->lineage->back().upcast;
+            const Message* header = static_cast<const Message*>(upcast ? upcast(msg) : msg);
+            deadline = header->Deadline();
+            sequence = header->Sequence();
+        }
+
+        const TypeRecordPtr& record;
+        void* msg;
+        Copier copier;
+        Completion completion;
+        int64_t deadline;
+        uint64_t sequence;
+        bool replay = false;        // a sticky value handed to a new subscriber
+        QThread* current = nullptr;
+        std::shared_ptr<const void> copy;
+        std::unique_ptr<Latch> latch;
+
+        // The copy shared by every queued or detached handler, made once.
+        const std::shared_ptr<const void>& Copy(bool movable) {
+            if (!copy)
+                copy = copier(msg, movable);
+            return copy;
+        }
+    };
+
+    struct TypeCounters {
+        struct alignas(64) Shard {
+            std::atomic<uint64_t> publishes { 0 };
+        };
+
+        std::atomic<size_t> tombstones { 0 };
+        std::atomic<uint64_t> delivered { 0 };
+        std::atomic<uint64_t> dropped { 0 };
+        std::atomic<uint64_t> merged { 0 };
+        Shard shards[kMetricShards];
+    };
+
+    // Last value of a sticky type. Like the counters it is shared by every
+    // version of the record, so publishing never has to swap the record.
+    // Publishing swaps in a new box and reading copies the value out of the
+    // current one; neither locks.
+    struct StickySlot {
+        using Box = const std::shared_ptr<const void>;
+
+        void Store(std::shared_ptr<const void> value) {
+            box.Store(new Box(std::move(value)));
+        }
 
-        for (const auto& subs : iter->second) {
-            subs.cb(msg);
+        // Under an EpochGuard.
+        std::shared_ptr<const void> Load() const {
+            Box* value = box.Load();
+            return value ? *value : nullptr;
         }
+
+        EpochPointer<Box> box;
+    };
+
+    // Everything Distribute needs to know about one message type. Replaced
+    // as a whole on change; counters are shared across versions.
+    // handlers is the flattened dispatch list for publishing this type:
+    // its own unkeyed subscribers followed by those of each base, and
+    // routes holds the keyed ones. Both are rebuilt
+    // whenever any type in the lineage changes, so Publish stays a single
+    // array walk.
+    struct TypeRecord {
+        Subscribers subscribers;
+        Router router {};
+        const Lineage* lineage = nullptr;   // known once the type is published
+        Copier copier = nullptr;            // likewise
+        std::vector<Handler> handlers;
+        std::vector<RouteGroup> routes;
+        bool parallel = false;
+        bool conflate = false;
+        bool sequenced = false;             // sticky types are regardless
+        Merge merge;
+        std::shared_ptr<StickySlot> sticky;     // null unless the type is sticky
+        std::shared_ptr<TypeCounters> counters = std::make_shared<TypeCounters>();
+        std::shared_ptr<const QString> name;    // demangled once, for reports
+    };
+
+    // msg is empty for a conflated call, which takes whatever is pending
+    // on the subscription when it runs.
+    struct QueuedCall {
+        QueuedCall* next;
+        TypeRecordPtr record;       // keeps handler alive
+        const Handler* handler;
+        std::shared_ptr<const void> msg;
+        Priority priority;
+        int64_t enqueued;
+        int64_t deadline;
+        uint64_t sequence;          // 0 unless the type is sticky
+        bool replay;
+    };
+    using CallPool = BlockPool<sizeof(QueuedCall), alignof(QueuedCall)>;
+
+    // Optional handler timing, see MessageCenter::SetInstrumentation. With
+    // LLMMSG_NO_METRICS it is never enabled and Run is a plain call.
+    class Instruments {
+    public:
+        explicit Instruments(MessageCenter* center)
+            : center_(center)
+        {
+
+        }
+
+        bool Enabled() const {
+#ifdef LLMMSG_NO_METRICS
+            return false;
+#else
+            return enabled_.load(std::memory_order_relaxed);
+#endif
+        }
+
+        void SetEnabled(bool enable) {
+            enabled_.store(enable, std::memory_order_relaxed);
+        }
+
+        void SetBudget(int64_t budget) {
+            budget_.store(budget, std::memory_order_relaxed);
+        }
+
+        void Count(TypeCounters& counters) const {
+            if (Enabled())
+                counters.shards[MetricShard()].publishes.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // msg is already cast to the subscribed type.
+        void Run(const SubscriberInfo& info, void* msg, bool movable) const {
+            if (!Enabled()) {
+                info.cb(msg, movable);
+                return;
+            }
+
+            const int64_t start = Now();
+            info.cb(msg, movable);
+            Record(info, Now() - start);
+        }
+
+    private:
+        void Record(const SubscriberInfo& info, int64_t elapsed) const {
+            HandlerCounters::Shard& shard = Counters(*info.state).shards[MetricShard()];
+            shard.calls.fetch_add(1, std::memory_order_relaxed);
+            shard.total.fetch_add(elapsed, std::memory_order_relaxed);
+            shard.histogram[Bucket(elapsed)].fetch_add(1, std::memory_order_relaxed);
+            if (elapsed > shard.max.load(std::memory_order_relaxed))
+                shard.max.store(elapsed, std::memory_order_relaxed);
+
+            const int64_t budget = budget_.load(std::memory_order_relaxed);
+            if (budget > 0 && elapsed > budget) {
+                shard.slow.fetch_add(1, std::memory_order_relaxed);
+                emit center_->SigSlowSubscriber(*info.state->name, info.options.context, elapsed);
+            }
+        }
+
+        static HandlerCounters& Counters(SubscriptionState& state) {
+            HandlerCounters* counters = state.metrics.load(std::memory_order_acquire);
+            if (counters)
+                return *counters;
+
+            auto made = new HandlerCounters;
+            if (state.metrics.compare_exchange_strong(counters, made, std::memory_order_acq_rel))
+                return *made;
+            delete made;
+            return *counters;
+        }
+
+        static size_t Bucket(int64_t elapsed) {
+            size_t bucket = 0;
+            while (elapsed > 1 && bucket + 1 < kLatencyBuckets) {
+                elapsed >>= 1;
+                ++bucket;
+            }
+            return bucket;
+        }
+
+    private:
+        MessageCenter* center_;
+        std::atomic<bool> enabled_ { false };
+        std::atomic<int64_t> budget_ { 0 };
+    };
+
+    // Lives in the target thread and drains its queue when poked.
+    class Dispatcher : public QObject {
+    public:
+        explicit Dispatcher(ThreadQueue* queue)
+            : queue_(queue)
+        {
+
+        }
+
+        bool event(QEvent* e) override {
+            if (e->type() != DrainEvent())
+                return QObject::event(e);
+
+            queue_->Drain();
+            return true;
+        }
+
+    private:
+        ThreadQueue* queue_;
+    };
+
+    struct Schedule {
+        std::atomic<Scheduling> scheduling { Scheduling::Strict };
+        std::atomic<uint32_t> weights[kPriorityLanes] { { 8 }, { 4 }, { 1 } };
+    };
+
+    // Multi-producer, single-consumer queue for one receiver thread, with
+    // a lane per priority. Producers push lock-free; only the push that
+    // finds the whole queue empty posts an event, so one event drains a
+    // batch. A drain serves at most kDrainBatch calls and re-posts itself
+    // so a flooded queue can't starve the thread's event loop.
+    class ThreadQueue {
+    public:
+        ThreadQueue(QThread* thread, const Schedule& schedule, const Instruments& instruments)
+            : thread_(thread)
+            , schedule_(schedule)
+            , instruments_(instruments)
+            , dispatcher_(new Dispatcher(this))
+        {
+            dispatcher_->moveToThread(thread);
+        }
+
+        ~ThreadQueue() {
+            for (Lane& lane : lanes_) {
+                Free(lane.head.exchange(nullptr, std::memory_order_acquire));
+                Free(lane.local);
+            }
+            Close();
+        }
+
+        void Push(QueuedCall* call, Priority priority) {
+            Lane& lane = lanes_[static_cast<size_t>(priority)];
+            lane.depth.fetch_add(1, std::memory_order_relaxed);
+            QueuedCall* head = lane.head.load(std::memory_order_relaxed);
+            do {
+                call->next = head;
+            } while (!lane.head.compare_exchange_weak(head, call, std::memory_order_release, std::memory_order_relaxed));
+
+            if (queued_.fetch_add(1, std::memory_order_acq_rel) == 0)
+                Post();
+        }
+
+        void Drain() {
+            size_t budget = kDrainBatch;
+            while (budget > 0) {
+                QueuedCall* call = Next();
+                if (!call)
+                    return;
+
+                Dispatch(call);
+                --budget;
+                queued_.fetch_sub(1, std::memory_order_acq_rel);
+            }
+            if (queued_.load(std::memory_order_acquire) > 0)
+                Post();
+        }
+
+        // Called on the target thread as it finishes; the dispatcher goes
+        // with the thread's deferred deletions and no more events are posted.
+        void Close() {
+            std::unique_lock<std::mutex> ulock(post_mtx_);
+            if (dispatcher_)
+                dispatcher_->deleteLater();
+            dispatcher_ = nullptr;
+        }
+
+        QObject* Context() const {
+            return dispatcher_;
+        }
+
+        ReceiverStats Stats() const {
+            ReceiverStats stats;
+            stats.thread = thread_;
+            for (size_t i = 0; i < kPriorityLanes; ++i) {
+                const Lane& lane = lanes_[i];
+                stats.lanes[i] = LaneStats {
+                    lane.depth.load(std::memory_order_relaxed),
+                    lane.delivered.load(std::memory_order_relaxed),
+                    lane.expired.load(std::memory_order_relaxed),
+                    lane.total_wait.load(std::memory_order_relaxed),
+                    lane.max_wait.load(std::memory_order_relaxed)
+                };
+            }
+            return stats;
+        }
+
+    private:
+        struct Lane {
+            std::atomic<QueuedCall*> head { nullptr };
+            // consumer side, FIFO
+            QueuedCall* local = nullptr;
+            QueuedCall* local_tail = nullptr;
+            uint32_t credit = 0;
+
+            std::atomic<size_t> depth { 0 };
+            std::atomic<uint64_t> delivered { 0 };
+            std::atomic<uint64_t> expired { 0 };
+            std::atomic<int64_t> total_wait { 0 };
+            std::atomic<int64_t> max_wait { 0 };
+        };
+
+        void Post() {
+            std::unique_lock<std::mutex> ulock(post_mtx_);
+            if (dispatcher_)
+                QCoreApplication::postEvent(dispatcher_, new QEvent(DrainEvent()));
+        }
+
+        // Moves whatever producers pushed into the lane's local FIFO.
+        static bool Refill(Lane& lane) {
+            if (!lane.head.load(std::memory_order_relaxed))
+                return !!lane.local;
+
+            QueuedCall* batch = Reverse(lane.head.exchange(nullptr, std::memory_order_acquire));
+            if (!batch)
+                return !!lane.local;
+
+            if (lane.local)
+                lane.local_tail->next = batch;
+            else
+                lane.local = batch;
+            while (batch->next)
+                batch = batch->next;
+            lane.local_tail = batch;
+            return true;
+        }
+
+        static QueuedCall* Pop(Lane& lane) {
+            QueuedCall* call = lane.local;
+            lane.local = call->next;
+            if (!lane.local)
+                lane.local_tail = nullptr;
+            lane.depth.fetch_sub(1, std::memory_order_relaxed);
+            return call;
+        }
+
+        // Higher lanes are re-checked before every pick, so an urgent call
+        // pushed mid-drain goes ahead of the backlog.
+        QueuedCall* Next() {
+            bool ready[kPriorityLanes];
+            bool any = false;
+            for (size_t i = 0; i < kPriorityLanes; ++i) {
+                ready[i] = Refill(lanes_[i]);
+                any = any || ready[i];
+            }
+            if (!any)
+                return nullptr;
+
+            if (schedule_.scheduling.load(std::memory_order_relaxed) == Scheduling::Strict) {
+                for (size_t i = 0; i < kPriorityLanes; ++i) {
+                    if (ready[i])
+                        return Pop(lanes_[i]);
+                }
+            }
+
+            for (int round = 0; round < 2; ++round) {
+                for (size_t i = 0; i < kPriorityLanes; ++i) {
+                    if (ready[i] && lanes_[i].credit > 0) {
+                        --lanes_[i].credit;
+                        return Pop(lanes_[i]);
+                    }
+                }
+                for (size_t i = 0; i < kPriorityLanes; ++i)
+                    lanes_[i].credit = std::max<uint32_t>(1, schedule_.weights[i].load(std::memory_order_relaxed));
+            }
+            return nullptr;
+        }
+
+        void Dispatch(QueuedCall* call) {
+            Lane& lane = lanes_[static_cast<size_t>(call->priority)];
+            const int64_t now = Now();
+            const int64_t wait = now - call->enqueued;
+            lane.total_wait.fetch_add(wait, std::memory_order_relaxed);
+            if (wait > lane.max_wait.load(std::memory_order_relaxed))
+                lane.max_wait.store(wait, std::memory_order_relaxed);
+
+            if (Invoke(*call, now))
+                lane.delivered.fetch_add(1, std::memory_order_relaxed);
+            else
+                lane.expired.fetch_add(1, std::memory_order_relaxed);
+            Destroy(call);
+        }
+
+        // false when the message had expired and was dropped
+        bool Invoke(QueuedCall& call, int64_t now) {
+            const Handler& handler = *call.handler;
+            SubscriptionState& state = *handler.info.state;
+            if (!state.alive.load(std::memory_order_acquire))
+                return true;
+
+            if (call.msg) {
+                if (call.sequence && !Admit(state, call.record->lineage->front().type, call.sequence, call.replay))
+                    return true;
+                if (Expired(call.deadline, now))
+                    return false;
+
+                instruments_.Run(handler.info, handler.Cast(const_cast<void*>(call.msg.get())), false);
+                return true;
+            }
+
+            std::shared_ptr<const void> msg;
+            size_t type;
+            Upcast upcast;
+            int64_t deadline;
+            uint64_t sequence;
+            bool replay;
+            {
+                std::unique_lock<std::mutex> ulock(state.mtx);
+                msg = std::move(state.pending);
+                type = state.pending_type;
+                upcast = state.pending_upcast;
+                deadline = state.pending_deadline;
+                sequence = state.pending_sequence;
+                replay = state.pending_replay;
+            }
+            if (!msg)
+                return true;
+            if (sequence && !Admit(state, type, sequence, replay))
+                return true;
+            if (Expired(deadline, now))
+                return false;
+
+            call.record->counters->delivered.fetch_add(1, std::memory_order_relaxed);
+            void* _msg = const_cast<void*>(msg.get());
+            instruments_.Run(handler.info, upcast ? upcast(_msg) : _msg, false);
+            return true;
+        }
+
+        static QueuedCall* Reverse(QueuedCall* calls) {
+            QueuedCall* fifo = nullptr;
+            while (calls) {
+                QueuedCall* next = calls->next;
+                calls->next = fifo;
+                fifo = calls;
+                calls = next;
+            }
+            return fifo;
+        }
+
+        static void Free(QueuedCall* calls) {
+            while (calls) {
+                QueuedCall* next = calls->next;
+                Destroy(calls);
+                calls = next;
+            }
+        }
+
+    private:
+        static constexpr size_t kDrainBatch = 1024;
+
+        QThread* thread_;
+        const Schedule& schedule_;
+        const Instruments& instruments_;
+        Lane lanes_[kPriorityLanes];
+        std::atomic<size_t> queued_ { 0 };
+        std::mutex post_mtx_;
+        QObject* dispatcher_;
+    };
+
+    explicit MessageCenterImpl(MessageCenter* center)
+        : subsc_(new SubscType())
+        , instruments_(center)
+        , queues_(new QueueMap())
+        , last_metrics_(Now())
+    {
+
+    }
+
+    // Readers never lock: under an EpochGuard they load the current
+    // snapshot and pin the one record they publish. The guard is gone
+    // before any handler runs, so a handler that blocks doesn't hold back
+    // reclamation. Handlers are free to publish or subscribe re-entrantly.
+    void Distribute(size_t type, void* msg, bool movable, Copier copier, const Lineage& lineage, Completion completion) {
+        const TypeRecordPtr record = Pin(type, lineage, copier);
+        if (record->sequenced || record->sticky) {
+            Upcast upcast = lineage.back().upcast;
+            static_cast<Message*>(upcast ? upcast(msg) : msg)->sequence_ = sequence_.fetch_add(1, std::memory_order_relaxed) + 1;
+        }
+        Publication pub { record, msg, copier, completion };
+        instruments_.Count(*record->counters);
+        // Taken before any handler can move from the message; queued
+        // subscribers share the same copy.
+        if (record->sticky)
+            record->sticky->Store(pub.Copy(false));
+
+        const size_t count = record->handlers.size();
+        // Parallel handlers may still be reading the message while the last
+        // one runs, so only an unshared message may be moved from.
+        const bool exclusive = movable && record->routes.empty() && !record->parallel;
+        for (size_t i = 0; i < count; ++i)
+            Deliver(pub, record->handlers[i], exclusive && i + 1 == count);
+
+        for (const RouteGroup& group : record->routes) {
+            Matching(group, msg, [&](const Handler& handler) {
+                Deliver(pub, handler, false);
+                return false;
+            });
+        }
+
+        if (pub.latch)
+            Pool().Wait(*pub.latch);
     }
 
-    void Register(bool unique, const std::type_index& type, SubscriberInfo&& info) {
-        std::unique_lock<std::mutex> ulock(mtx_);
-        if (unique && Exist(type, info))
+    TypeRecordPtr Pin(size_t type, const Lineage& lineage, Copier copier) {
+        EpochGuard guard;
+        const SubscType* subsc = subsc_.Load();
+        if (type < subsc->size() && (*subsc)[type] && (*subsc)[type]->lineage)
+            return (*subsc)[type];
+
+        // First publish of this type: resolve its handlers once.
+        Update(type, [&](TypeRecord& record) {
+            record.lineage = &lineage;
+            record.copier = copier;
+        });
+        return (*subsc_.Load())[type];
+    }
+
+    // Writers are serialized by write_mtx_ and publish a fresh copy of the
+    // touched record; records pinned by running Distribute calls stay valid.
+    std::shared_ptr<SubscriptionState> Register(bool unique, SubscriberInfo&& info) {
+        auto state = std::make_shared<SubscriptionState>();
+        state->type = info.type;
+        info.state = state;
+
+        QObject* context = info.options.context;
+        if (info.options.delivery != Delivery::Direct && !context)
+            qWarning() << "MessageCenter: Queued/Auto subscription to" << MessageTypeName(info.type) << "has no context and runs Direct";
+
+        bool added = false;
+        Update(info.type, [&](TypeRecord& record) {
+            state->name = record.name;
+            if (unique) {
+                if (auto exist = Exist(record, info)) {
+                    state = exist;
+                    return;
+                }
+            }
+
+            const RouteKey& key = info.options.key;
+            if (key && record.router.type && *record.router.type != key.Type())
+                qWarning() << "MessageCenter: routing key type" << key.Type().name() << "never matches" << record.router.type->name();
+
+            record.subscribers.reserve(record.subscribers.size() + 1);
+            record.subscribers.emplace_back(std::move(info));
+            added = true;
+        });
+
+        if (added && context) {
+            std::weak_ptr<SubscriptionState> weak = state;
+            state->destroyed = QObject::connect(context, &QObject::destroyed, [this, weak]() {
+                if (auto state = weak.lock())
+                    Unsubscribe(state);
+            });
+        }
+        if (added)
+            Replay(state);
+        return state;
+    }
+
+    // Tombstones the entry so Distribute and pending queued calls skip it.
+    // The list is rebuilt only once the dead outnumber the living, which
+    // keeps unsubscribing O(1) amortized and publishing untouched.
+    void Unsubscribe(const std::shared_ptr<SubscriptionState>& state) {
+        if (!state->alive.exchange(false, std::memory_order_acq_rel))
+            return;
+
+        QObject::disconnect(state->destroyed);
+        {
+            std::unique_lock<std::mutex> ulock(state->mtx);
+            state->pending.reset();
+        }
+
+        EpochGuard guard;
+        const SubscType* subsc = subsc_.Load();
+        const TypeRecord& record = *(*subsc)[state->type];
+        const size_t dead = record.counters->tombstones.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (dead < kMinCompact || dead * 2 < record.subscribers.size())
             return;
 
-        subsc_[type].emplace_back(std::move(info));
+        Update(state->type, [](TypeRecord& record) {
+            auto& subscribers = record.subscribers;
+            const size_t size = subscribers.size();
+            subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(), [](const SubscriberInfo& info) {
+                return !info.state->alive.load(std::memory_order_acquire);
+            }), subscribers.end());
+            record.counters->tombstones.fetch_sub(size - subscribers.size(), std::memory_order_relaxed);
+        });
+    }
+
+    void SetRoutingKey(size_t type, Router&& router) {
+        Update(type, [&](TypeRecord& record) {
+            record.router = std::move(router);
+        });
+    }
+
+    void SetConflation(size_t type, bool enable, Merge&& merge) {
+        Update(type, [&](TypeRecord& record) {
+            record.conflate = enable;
+            record.merge = std::move(merge);
+        });
+    }
+
+    void SetSticky(size_t type, bool enable) {
+        Update(type, [&](TypeRecord& record) {
+            if (!enable)
+                record.sticky.reset();
+            else if (!record.sticky)
+                record.sticky = std::make_shared<StickySlot>();
+        });
+    }
+
+    void SetSequenced(size_t type, bool enable) {
+        Update(type, [&](TypeRecord& record) {
+            record.sequenced = enable;
+        });
+    }
+
+    std::shared_ptr<const void> LastValue(size_t type) const {
+        EpochGuard guard;
+        const SubscType* subsc = subsc_.Load();
+        if (type >= subsc->size() || !(*subsc)[type] || !(*subsc)[type]->sticky)
+            return nullptr;
+
+        return (*subsc)[type]->sticky->Load();
+    }
+
+    void SetScheduling(Scheduling scheduling, const std::array<uint32_t, kPriorityLanes>& weights) {
+        for (size_t i = 0; i < kPriorityLanes; ++i)
+            schedule_.weights[i].store(weights[i], std::memory_order_relaxed);
+        schedule_.scheduling.store(scheduling, std::memory_order_relaxed);
+    }
+
+    std::vector<ReceiverStats> QueueStats() const {
+        EpochGuard guard;
+        const QueueMap* queues = queues_.Load();
+        std::vector<ReceiverStats> stats;
+        stats.reserve(queues->size());
+        for (const auto& queue : *queues)
+            stats.push_back(queue.second->Stats());
+        return stats;
+    }
+
+    void SetInstrumentation(bool enable) {
+        instruments_.SetEnabled(enable);
+    }
+
+    void SetSlowSubscriberBudget(std::chrono::nanoseconds budget) {
+        instruments_.SetBudget(budget.count());
+    }
+
+    // Sums the shards of every type and live subscriber. Rates are taken
+    // over the time since the previous snapshot.
+    MetricsSnapshot Metrics() {
+        MetricsSnapshot snapshot;
+#ifndef LLMMSG_NO_METRICS
+        EpochGuard guard;
+        const SubscType* subsc = subsc_.Load();
+        std::unique_lock<std::mutex> ulock(metrics_mtx_);
+        const int64_t now = Now();
+        snapshot.interval_ns = now - last_metrics_;
+        last_metrics_ = now;
+        if (last_publishes_.size() < subsc->size())
+            last_publishes_.resize(subsc->size(), 0);
+
+        for (size_t type = 0; type < subsc->size(); ++type) {
+            const TypeRecordPtr& record = (*subsc)[type];
+            if (!record)
+                continue;
+
+            TypeStats stats;
+            for (const TypeCounters::Shard& shard : record->counters->shards)
+                stats.publishes += shard.publishes.load(std::memory_order_relaxed);
+            for (const SubscriberInfo& info : record->subscribers) {
+                if (info.state->alive.load(std::memory_order_acquire))
+                    stats.handlers.push_back(Handled(info));
+            }
+            if (stats.publishes == 0 && stats.handlers.empty())
+                continue;
+
+            stats.name = *record->name;
+            if (snapshot.interval_ns > 0)
+                stats.rate = (stats.publishes - last_publishes_[type]) * 1e9 / snapshot.interval_ns;
+            last_publishes_[type] = stats.publishes;
+            snapshot.types.push_back(std::move(stats));
+        }
+#endif
+        return snapshot;
+    }
+
+    ConflationStats Conflation(size_t type) const {
+        EpochGuard guard;
+        const SubscType* subsc = subsc_.Load();
+        if (type >= subsc->size() || !(*subsc)[type])
+            return {};
+
+        const TypeCounters& counters = *(*subsc)[type]->counters;
+        return ConflationStats {
+            counters.delivered.load(std::memory_order_relaxed),
+            counters.dropped.load(std::memory_order_relaxed),
+            counters.merged.load(std::memory_order_relaxed)
+        };
     }
 
 private:
-    bool Exist(const std::type_index& type, const SubscriberInfo& info) {
-        auto iter = subsc_.find(type);
-        if (iter == subsc_.end())
-            return false;
+    static QEvent::Type DrainEvent() {
+        static const QEvent::Type type = static_cast<QEvent::Type>(QEvent::registerEventType());
+        return type;
+    }
 
-        for (const auto& subs : iter->second) {
-            if (info.receiver == subs.receiver && info.func == subs.func)
-                return true;
+    void Deliver(Publication& pub, const Handler& handler, bool last) {
+        const SubscriberInfo& info = handler.info;
+        if (!info.state->alive.load(std::memory_order_acquire))
+            return;
+
+        QThread* target = Target(info.options, pub.current);
+        if (!target) {
+            if (pub.record->sticky && !Admit(*info.state, pub.record->lineage->front().type, pub.sequence, pub.replay))
+                return;
+            if (info.options.parallel)
+                Fork(pub, handler);
+            else
+                instruments_.Run(info, handler.Cast(pub.msg), last);
+            return;
+        }
+
+        if (pub.record->conflate || info.options.conflate) {
+            Conflate(target, pub, handler);
+            return;
+        }
+
+        Enqueue(target, pub, handler, pub.Copy(last));
+    }
+
+    // Joined tasks read the caller's message and are waited for at the end
+    // of Distribute; detached ones keep a shared copy alive.
+    void Fork(Publication& pub, const Handler& handler) {
+        if (pub.completion == Completion::Detach) {
+            Pool().Submit([this, record = pub.record, &handler, msg = pub.Copy(false)]() {
+                if (handler.info.state->alive.load(std::memory_order_acquire))
+                    instruments_.Run(handler.info, handler.Cast(const_cast<void*>(msg.get())), false);
+            });
+            return;
+        }
+
+        if (!pub.latch)
+            pub.latch = std::make_unique<Latch>();
+        pub.latch->Add();
+        Pool().Submit([this, &handler, msg = pub.msg, latch = pub.latch.get()]() {
+            instruments_.Run(handler.info, handler.Cast(msg), false);
+            latch->CountDown();
+        });
+    }
+
+    // Started on first use so that processes without parallel subscribers
+    // don't pay for idle threads.
+    WorkStealingPool& Pool() {
+        std::call_once(pool_once_, [this]() {
+            const size_t cores = std::max(2u, std::thread::hardware_concurrency());
+            pool_ = std::make_unique<WorkStealingPool>(cores - 1);
+        });
+        return *pool_;
+    }
+
+    static int64_t Now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static HandlerStats Handled(const SubscriberInfo& info) {
+        HandlerStats stats;
+        stats.context = info.options.context;
+        stats.receiver = info.receiver;
+        const HandlerCounters* counters = info.state->metrics.load(std::memory_order_acquire);
+        if (!counters)
+            return stats;
+
+        for (const HandlerCounters::Shard& shard : counters->shards) {
+            stats.calls += shard.calls.load(std::memory_order_relaxed);
+            stats.slow += shard.slow.load(std::memory_order_relaxed);
+            stats.total_ns += shard.total.load(std::memory_order_relaxed);
+            stats.max_ns = std::max<int64_t>(stats.max_ns, shard.max.load(std::memory_order_relaxed));
+            for (size_t i = 0; i < kLatencyBuckets; ++i)
+                stats.histogram[i] += shard.histogram[i].load(std::memory_order_relaxed);
+        }
+        return stats;
+    }
+
+    static bool Expired(int64_t deadline, int64_t now) {
+        return deadline != 0 && now > deadline;
+    }
+
+    // Whether a sticky value may reach the handler now. A live one always
+    // may, and is remembered while a replay is under way; a replayed one
+    // only if no live value of its type as new got there first.
+    static bool Admit(SubscriptionState& state, size_t type, uint64_t sequence, bool replay) {
+        if (!replay && state.replaying.load(std::memory_order_seq_cst) == 0)
+            return true;
+
+        std::unique_lock<std::mutex> ulock(state.mtx);
+        auto iter = std::find_if(state.seen.begin(), state.seen.end(), [type](const std::pair<size_t, uint64_t>& seen) {
+            return seen.first == type;
+        });
+        const bool fresh = iter == state.seen.end() || iter->second < sequence;
+        if (fresh && iter == state.seen.end())
+            state.seen.emplace_back(type, sequence);
+        else if (fresh)
+            iter->second = sequence;
+        if (replay)
+            Replayed(state);
+        return fresh || !replay;
+    }
+
+    // One replayed value, or the replay itself, is done with; under mtx.
+    static void Replayed(SubscriptionState& state) {
+        if (state.replaying.fetch_sub(1, std::memory_order_seq_cst) == 1)
+            state.seen.clear();
+    }
+
+    static void Destroy(QueuedCall* call) {
+        call->~QueuedCall();
+        CallPool::Instance().Release(call);
+    }
+
+    // Thread to queue the call to, or nullptr to run it in place.
+    static QThread* Target(const SubscribeOptions& options, QThread*& current) {
+        if (options.delivery == Delivery::Direct || !options.context)
+            return nullptr;
+
+        QThread* target = options.context->thread();
+        if (options.delivery == Delivery::Auto) {
+            if (!current)
+                current = QThread::currentThread();
+            if (target == current)
+                return nullptr;
         }
-        return false;
+        return target;
+    }
+
+    // Copy-and-swap of one record; every published type that has the
+    // edited type in its lineage gets its handlers rebuilt in the same swap.
+    template<typename Edit>
+    void Update(size_t type, Edit&& edit) {
+        std::unique_lock<std::mutex> ulock(write_mtx_);
+        auto next = std::make_unique<SubscType>(*subsc_.Load());
+        if (type >= next->size())
+            next->resize(type + 1);
+
+        auto record = (*next)[type]
+                ? std::make_shared<TypeRecord>(*(*next)[type])
+                : std::make_shared<TypeRecord>();
+        if (!record->name)
+            record->name = std::make_shared<const QString>(MessageTypeName(type));
+        edit(*record);
+        (*next)[type] = record;
+
+        for (TypeRecordPtr& entry : *next) {
+            if (!entry || !entry->lineage || !Inherits(*entry->lineage, type))
+                continue;
+
+            auto resolved = entry == record ? record : std::make_shared<TypeRecord>(*entry);
+            Resolve(*next, *resolved);
+            entry = std::move(resolved);
+        }
+        subsc_.Store(next.release());
+        EpochDomain::Instance().Collect();
+    }
+
+    static bool Inherits(const Lineage& lineage, size_t type) {
+        return std::any_of(lineage.begin(), lineage.end(), [type](const LineageEntry& entry) {
+            return entry.type == type;
+        });
+    }
+
+    // Keyed subscribers whose key type doesn't match their type's router
+    // (or whose type has none yet) can never match and are left out.
+    static void Resolve(const SubscType& subsc, TypeRecord& record) {
+        record.handlers.clear();
+        record.routes.clear();
+        record.parallel = false;
+        for (const LineageEntry& entry : *record.lineage) {
+            if (entry.type >= subsc.size() || !subsc[entry.type])
+                continue;
+
+            const TypeRecord& base = *subsc[entry.type];
+            RouteGroup* group = nullptr;
+            for (const SubscriberInfo& info : base.subscribers) {
+                const RouteKey& key = info.options.key;
+                record.parallel = record.parallel || info.options.parallel;
+                if (!key) {
+                    record.handlers.push_back(Handler { info, entry.upcast });
+                    continue;
+                }
+
+                if (!base.router.type || *base.router.type != key.Type())
+                    continue;
+
+                if (!group) {
+                    record.routes.push_back(RouteGroup { base.router, entry.upcast, {} });
+                    group = &record.routes.back();
+                }
+                group->index[key.Hash()].push_back(Handler { info, entry.upcast });
+            }
+        }
+    }
+
+    void Enqueue(QThread* thread, const Publication& pub, const Handler& handler, const std::shared_ptr<const void>& msg) {
+        EpochGuard guard;
+        ThreadQueue* queue = Queue(thread);
+        const Priority priority = handler.info.options.priority;
+        QueuedCall* call = new (CallPool::Instance().Acquire()) QueuedCall {
+            nullptr, pub.record, &handler, msg, priority, Now(), pub.deadline,
+            pub.record->sticky ? pub.sequence : 0, pub.replay
+        };
+        queue->Push(call, priority);
+    }
+
+    // Keeps at most one delivery in flight per subscription: a publish that
+    // finds one pending replaces it, or folds into it when the type has a
+    // merge function, and only the first one queues a call.
+    void Conflate(QThread* thread, Publication& pub, const Handler& handler) {
+        const TypeRecordPtr& record = pub.record;
+        void* msg = pub.msg;
+        SubscriptionState& state = *handler.info.state;
+        TypeCounters& counters = *record->counters;
+        const size_t type = record->lineage->front().type;
+        {
+            std::unique_lock<std::mutex> ulock(state.mtx);
+            // Whatever is pending was published after the subscription, so
+            // it is at least as new as a replayed value.
+            if (state.pending && pub.replay) {
+                Replayed(state);
+                return;
+            }
+            if (state.pending && record->merge && state.pending_type == type) {
+                record->merge(const_cast<void*>(state.pending.get()), msg);
+                counters.merged.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            const bool replace = !!state.pending;
+            if (replace && state.pending_replay)
+                Replayed(state);
+            // Merging writes into the pending value, so it must not be the
+            // copy other subscribers share.
+            state.pending = record->merge ? pub.copier(msg, false) : pub.Copy(false);
+            state.pending_type = type;
+            state.pending_upcast = handler.upcast;
+            state.pending_deadline = pub.deadline;
+            state.pending_sequence = record->sticky ? pub.sequence : 0;
+            state.pending_replay = pub.replay;
+
+            if (replace) {
+                counters.dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+        Enqueue(thread, pub, handler, nullptr);
+    }
+
+    // Under an EpochGuard; the queue stays valid until the guard goes.
+    ThreadQueue* Queue(QThread* thread) {
+        const QueueMap* queues = queues_.Load();
+        auto iter = queues->find(thread);
+        if (iter != queues->end())
+            return iter->second.get();
+
+        std::unique_lock<std::mutex> ulock(queue_mtx_);
+        queues = queues_.Load();
+        iter = queues->find(thread);
+        if (iter != queues->end())
+            return iter->second.get();
+
+        auto queue = std::make_shared<ThreadQueue>(thread, schedule_, instruments_);
+        QObject::connect(thread, &QThread::finished, queue->Context(), [this, thread]() {
+            RemoveQueue(thread);
+        }, Qt::DirectConnection);
+
+        auto next = std::make_unique<QueueMap>(*queues);
+        (*next)[thread] = queue;
+        queues_.Store(next.release());
+        EpochDomain::Instance().Collect();
+        return queue.get();
+    }
+
+    void RemoveQueue(QThread* thread) {
+        std::unique_lock<std::mutex> ulock(queue_mtx_);
+        const QueueMap* queues = queues_.Load();
+        auto iter = queues->find(thread);
+        if (iter == queues->end())
+            return;
+
+        iter->second->Close();
+        auto next = std::make_unique<QueueMap>(*queues);
+        next->erase(thread);
+        queues_.Store(next.release());
+        EpochDomain::Instance().Collect();
+    }
+
+    // Hands a subscription that was just added the cached value of its type
+    // and of every sticky type derived from it, oldest first, through the
+    // same path a publish takes. A publish racing with the subscription may
+    // reach it first; a cached value no newer than what the handler was
+    // given of its type is then skipped. The check is made as the handler
+    // is entered, so a Direct handler run on the publisher's thread at the
+    // same moment is no more ordered than two publishes are.
+    void Replay(const std::shared_ptr<SubscriptionState>& state) {
+        struct Cached {
+            TypeRecordPtr record;
+            std::shared_ptr<const void> value;
+            uint64_t sequence;
+        };
+
+        // Counted before the values are read, so that a live publish they
+        // miss is remembered.
+        state->replaying.fetch_add(1, std::memory_order_seq_cst);
+        std::vector<Cached> cached;
+        {
+            // Left before any handler runs; the records are pinned.
+            EpochGuard guard;
+            for (const TypeRecordPtr& record : *subsc_.Load()) {
+                if (!record || !record->sticky || !record->lineage || !Inherits(*record->lineage, state->type))
+                    continue;
+
+                auto value = record->sticky->Load();
+                if (!value)
+                    continue;
+
+                Upcast upcast = record->lineage->back().upcast;
+                void* msg = const_cast<void*>(value.get());
+                const uint64_t sequence = static_cast<const Message*>(upcast ? upcast(msg) : msg)->Sequence();
+                cached.push_back(Cached { record, std::move(value), sequence });
+            }
+        }
+        std::sort(cached.begin(), cached.end(), [](const Cached& a, const Cached& b) {
+            return a.sequence < b.sequence;
+        });
+
+        for (const Cached& entry : cached) {
+            void* msg = const_cast<void*>(entry.value.get());
+            Publication pub { entry.record, msg, entry.record->copier, Completion::Join };
+            if (Expired(pub.deadline, Now()))
+                continue;
+
+            pub.copy = entry.value;
+            pub.replay = true;
+            if (const Handler* handler = Find(*entry.record, state.get(), msg)) {
+                state->replaying.fetch_add(1, std::memory_order_seq_cst);
+                Deliver(pub, *handler, false);
+            }
+            if (pub.latch)
+                Pool().Wait(*pub.latch);
+        }
+
+        std::unique_lock<std::mutex> ulock(state->mtx);
+        Replayed(*state);
+    }
+
+    // The resolved handler of a subscription within a record, or nullptr
+    // when its routing key doesn't match msg.
+    static const Handler* Find(const TypeRecord& record, const SubscriptionState* state, void* msg) {
+        for (const Handler& handler : record.handlers) {
+            if (handler.info.state.get() == state)
+                return &handler;
+        }
+
+        const Handler* found = nullptr;
+        for (const RouteGroup& group : record.routes) {
+            Matching(group, msg, [&](const Handler& handler) {
+                if (handler.info.state.get() == state)
+                    found = &handler;
+                return !!found;
+            });
+            if (found)
+                break;
+        }
+        return found;
+    }
+
+    // Calls fn with each keyed handler of the group whose key equals msg's,
+    // until it returns true. The key function runs once, whatever the
+    // number of handlers in the bucket.
+    template<typename Function>
+    static void Matching(const RouteGroup& group, void* msg, Function&& fn) {
+        auto visit = [&group, &fn](size_t hash, const void* key) {
+            auto iter = group.index.find(hash);
+            if (iter == group.index.end())
+                return;
+
+            for (const Handler& handler : iter->second) {
+                if (group.router.equal(key, handler.info.options.key.Value()) && fn(handler))
+                    return;
+            }
+        };
+        group.router.route(group.upcast ? group.upcast(msg) : msg, [](void* context, size_t hash, const void* key) {
+            (*static_cast<decltype(visit)*>(context))(hash, key);
+        }, &visit);
+    }
+
+    static std::shared_ptr<SubscriptionState> Exist(const TypeRecord& record, const SubscriberInfo& info) {
+        for (const auto& subs : record.subscribers) {
+            if (info.receiver == subs.receiver && info.func == subs.func && subs.state->alive.load(std::memory_order_acquire))
+                return subs.state;
+        }
+        return nullptr;
     }
 
 private:
-    std::mutex mtx_;
-    SubscType subsc_;
+    static constexpr size_t kMinCompact = 8;
+
+    std::mutex write_mtx_;
+    EpochPointer<const SubscType> subsc_;
+    Schedule schedule_;
+    Instruments instruments_;
+    std::mutex queue_mtx_;
+    EpochPointer<const QueueMap> queues_;
+    std::once_flag pool_once_;
+    std::unique_ptr<WorkStealingPool> pool_;
+    std::mutex metrics_mtx_;
+    int64_t last_metrics_;
+    std::vector<uint64_t> last_publishes_;
+    // Shared by every sequenced publish, so kept off the other members'
+    // cache lines.
+    alignas(64) std::atomic<uint64_t> sequence_ { 0 };
 };
 
 
 
-void MessageCenter::Distribute(std::type_index type, std::any&& msg) {
-    impl_->Distribute(type, std::move(msg));
+void MessageCenter::Distribute(size_t type, void* msg, bool movable, Copier copier, const Lineage& lineage, Completion completion) {
+    impl_->Distribute(type, msg, movable, copier, lineage, completion);
 }
 
 
 
-void MessageCenter::Register(bool unique, std::type_index type, std::function<void(std::any)>&& cb, uint64_t func, void* obj) {
-    MessageCenterImpl::SubscriberInfo info {
-        obj,
-        func,
-        std::move(cb)
-    };
-    impl_->Register(unique, type, std::move(info));
+Subscription MessageCenter::Register(bool unique, Subscriber&& subscriber) {
+    return Subscription(this, impl_->Register(unique, MessageCenterImpl::SubscriberInfo { std::move(subscriber), nullptr }));
+}
+
+
+
+void MessageCenter::Unsubscribe(const std::shared_ptr<SubscriptionState>& state) {
+    impl_->Unsubscribe(state);
+}
+
+
+
+void MessageCenter::SetConflation(size_t type, bool enable, Merge&& merge) {
+    impl_->SetConflation(type, enable, std::move(merge));
+}
+
+
+
+void MessageCenter::SetRoutingKey(size_t type, Router&& router) {
+    impl_->SetRoutingKey(type, std::move(router));
+}
+
+
+
+void MessageCenter::SetSticky(size_t type, bool enable) {
+    impl_->SetSticky(type, enable);
+}
+
+
+
+void MessageCenter::SetSequenced(size_t type, bool enable) {
+    impl_->SetSequenced(type, enable);
+}
+
+
+
+std::shared_ptr<const void> MessageCenter::LastValue(size_t type) const {
+    return impl_->LastValue(type);
+}
+
+
+
+void MessageCenter::SetScheduling(Scheduling scheduling, std::array<uint32_t, kPriorityLanes> weights) {
+    impl_->SetScheduling(scheduling, weights);
+}
+
+
+
+std::vector<ReceiverStats> MessageCenter::QueueStats() const {
+    return impl_->QueueStats();
+}
+
+
+
+void MessageCenter::SetInstrumentation(bool enable) {
+    impl_->SetInstrumentation(enable);
+}
+
+
+
+void MessageCenter::SetSlowSubscriberBudget(std::chrono::nanoseconds budget) {
+    impl_->SetSlowSubscriberBudget(budget);
+}
+
+
+
+MetricsSnapshot MessageCenter::Metrics() {
+    return impl_->Metrics();
+}
+
+
+
+ConflationStats MessageCenter::Conflation(size_t type) const {
+    return impl_->Conflation(type);
+}
+
+
+
+void Subscription::Cancel() {
+    if (auto state = state_.lock())
+        center_->Unsubscribe(state);
+}
+
+
+
+bool Subscription::Active() const {
+    auto state = state_.lock();
+    return state && state->alive.load(std::memory_order_acquire);
 }
 
 
 
 MessageCenter::MessageCenter()
-    : impl_(std::make_unique<MessageCenterImpl>())
+    : impl_(std::make_unique<MessageCenterImpl>(this))
 {
 
 }
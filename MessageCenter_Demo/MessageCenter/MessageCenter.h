@@ -3,15 +3,221 @@
 
 #define LLMMSG lilaomo::MessageCenter::Instance()
 
-#include <typeindex>
-#include <any>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <typeinfo>
+#include <vector>
 
 #include "MessageConst.h"
+#include "MessagePool.h"
+#include "MessageReply.h"
 
 #define BASE_OF(Msg) std::enable_if_t<std::is_base_of<Message, Msg>::value>
+#define BASE_OF_T(Msg, T) std::enable_if_t<std::is_base_of<Message, Msg>::value, T>
 
 namespace lilaomo {
 
+size_t NextMessageTypeId(const char* name);
+QString MessageTypeName(size_t type);
+
+// Dense per-type id, handed out the first time a message type is seen and
+// used to index the dispatch table directly.
+template<typename MsgType>
+size_t MessageTypeId() {
+    static const size_t id = NextMessageTypeId(typeid(MsgType).name());
+    return id;
+}
+
+using Upcast = void* (*)(void* msg);
+
+struct LineageEntry {
+    size_t type;
+    Upcast upcast;      // nullptr for the type itself
+};
+
+// A message type followed by its bases up to Message, built once per type.
+using Lineage = std::vector<LineageEntry>;
+
+template<typename MsgType, typename BaseType>
+void* UpcastMessage(void* msg) {
+    return static_cast<BaseType*>(static_cast<MsgType*>(msg));
+}
+
+template<typename MsgType, typename Type = MsgType>
+void AppendBases(Lineage& lineage) {
+    if constexpr (!std::is_same<Type, Message>::value) {
+        using BaseType = typename MessageBase<Type>::type;
+        lineage.push_back({ MessageTypeId<BaseType>(), &UpcastMessage<MsgType, BaseType> });
+        AppendBases<MsgType, BaseType>(lineage);
+    }
+}
+
+// Never freed: dispatch records point at it and may outlive static
+// destruction while detached or queued work drains at exit.
+template<typename MsgType>
+const Lineage& MessageLineage() {
+    static const Lineage* lineage = [] {
+        auto lineage = new Lineage { { MessageTypeId<MsgType>(), nullptr } };
+        AppendBases<MsgType>(*lineage);
+        return lineage;
+    }();
+    return *lineage;
+}
+
+enum class Delivery {
+    Direct,     // run on the publishing thread
+    Queued,     // run on the receiver's thread from its event loop
+    Auto        // Direct when published from the receiver's thread, else Queued
+};
+
+// Value a keyed subscription routes on. It must have the same type as the
+// key function registered with MessageCenter::SetRoutingKey returns.
+class RouteKey {
+public:
+    RouteKey() = default;
+
+    template<typename Key>
+    RouteKey(Key key)
+        : hash_(std::hash<Key>()(key))
+        , type_(&typeid(Key))
+        , value_(std::make_shared<const Key>(std::move(key)))
+    {
+
+    }
+
+    explicit operator bool() const { return !!value_; }
+
+    size_t Hash() const { return hash_; }
+    const std::type_info& Type() const { return *type_; }
+    const void* Value() const { return value_.get(); }
+
+private:
+    size_t hash_ = 0;
+    const std::type_info* type_ = nullptr;
+    std::shared_ptr<const void> value_;
+};
+
+// Queued deliveries to one thread wait in a lane per priority.
+enum class Priority {
+    High,
+    Normal,
+    Low
+};
+constexpr size_t kPriorityLanes = 3;
+
+// How a receiver thread picks the next lane to serve.
+enum class Scheduling {
+    Strict,     // always the highest non-empty lane
+    Weighted    // round robin, each lane serving up to its weight in turn
+};
+
+struct LaneStats {
+    size_t depth = 0;           // calls waiting now
+    uint64_t delivered = 0;
+    uint64_t expired = 0;       // dropped because the message's deadline passed
+    int64_t total_wait = 0;     // ns between enqueue and dispatch, summed
+    int64_t max_wait = 0;
+};
+
+struct ReceiverStats {
+    QThread* thread = nullptr;
+    LaneStats lanes[kPriorityLanes];
+};
+
+struct SubscribeOptions {
+    SubscribeOptions(Delivery delivery = Delivery::Direct, Priority priority = Priority::Normal)
+        : delivery(delivery)
+        , priority(priority)
+    {
+
+    }
+
+    Delivery delivery;
+    Priority priority;
+    // Queued deliveries only: while one is pending, newer messages replace
+    // it (or merge into it, see MessageCenter::SetConflation).
+    bool conflate = false;
+    // Thread affinity for Queued/Auto lambda subscriptions, which run Direct
+    // without one; member function subscriptions on a QObject use the
+    // object itself.
+    QObject* context = nullptr;
+    // Only deliver messages whose routing key equals this one.
+    RouteKey key;
+    // Direct deliveries only: the handler is thread-safe and may run on the
+    // center's worker pool concurrently with the other handlers.
+    bool parallel = false;
+};
+
+// What Publish waits for when a type has parallel subscribers. Handlers
+// that aren't parallel always run in order before Publish returns.
+enum class Completion {
+    Join,       // parallel handlers have finished when Publish returns
+    Detach      // fire and forget; they work on a shared copy
+};
+
+struct ConflationStats {
+    uint64_t delivered = 0;     // conflated deliveries that reached a handler
+    uint64_t dropped = 0;       // pending messages replaced by a newer one
+    uint64_t merged = 0;        // messages folded into a pending one
+};
+
+// Handler time histogram: bucket i counts calls that took [2^i, 2^(i+1))
+// ns, the last one everything slower.
+constexpr size_t kLatencyBuckets = 32;
+
+struct HandlerStats {
+    QObject* context = nullptr;
+    const void* receiver = nullptr;     // the subscribed object, if any
+    uint64_t calls = 0;
+    uint64_t slow = 0;                  // calls over the slow subscriber budget
+    int64_t total_ns = 0;
+    int64_t max_ns = 0;
+    std::array<uint64_t, kLatencyBuckets> histogram {};
+};
+
+struct TypeStats {
+    QString name;
+    uint64_t publishes = 0;
+    double rate = 0;                    // publishes per second since the previous snapshot
+    std::vector<HandlerStats> handlers; // subscribers of this type, in order
+};
+
+struct MetricsSnapshot {
+    int64_t interval_ns = 0;            // since the previous snapshot
+    std::vector<TypeStats> types;
+};
+
+class MessageCenter;
+class SubscriptionState;
+
+// Handle returned by MessageCenter::Subscribe. Copies refer to the same
+// subscription; letting it go out of scope does not unsubscribe.
+class Subscription {
+public:
+    Subscription() = default;
+
+    // O(1): the entry is tombstoned now and compacted away later.
+    void Cancel();
+    bool Active() const;
+
+private:
+    friend class MessageCenter;
+
+    Subscription(MessageCenter* center, std::weak_ptr<SubscriptionState> state)
+        : center_(center)
+        , state_(std::move(state))
+    {
+
+    }
+
+private:
+    MessageCenter* center_ = nullptr;
+    std::weak_ptr<SubscriptionState> state_;
+};
+
 class MessageCenter : public QObject
 {
     Q_OBJECT
@@ -24,39 +230,277 @@ public:
         return &_this;
     }
 
-    template<typename MsgType>
-    BASE_OF(MsgType) Publish(MsgType&& msg) {
-        std::any _msg = std::forward<MsgType>(msg);
-        Distribute(typeid(MsgType), std::move(_msg));
+    // Every subscriber is handed a reference to the caller's message; only
+    // an rvalue may be moved into the last by-value handler. Queued
+    // subscribers share one copy made on demand. Subscribers of any base
+    // in MsgType's MessageBase chain receive it as well.
+    //
+    // The message is stamped with its timestamp and sequence in place. A
+    // const one may be read by other threads meanwhile, so a stamped copy
+    // of it is published instead.
+    template<typename MsgType, typename Type = std::decay_t<MsgType>>
+    BASE_OF(Type) Publish(MsgType&& msg, Completion completion = Completion::Join) {
+        if constexpr (std::is_const<std::remove_reference_t<MsgType>>::value) {
+            Type copy(msg);
+            Publish(std::move(copy), completion);
+        } else {
+            constexpr bool movable = !std::is_lvalue_reference<MsgType>::value;
+            Stamp(msg);
+            Distribute(MessageTypeId<Type>(), &msg, movable, &CopyMessage<Type>, MessageLineage<Type>(), completion);
+        }
     }
 
     template<typename MsgType, typename RetType, typename ClassType>
-    BASE_OF(MsgType) Subscribe(RetType (ClassType::* func)(MsgType), ClassType* obj) {
-        Register(false, typeid(MsgType), [func, obj](const std::any& msg) {
-            const MsgType& _msg = std::any_cast<const MsgType&>(msg);
-            (obj->*func)(_msg);
-        }, reinterpret_cast<uint64_t>(func), static_cast<void*>(obj));
+    BASE_OF_T(MsgType, Subscription) Subscribe(RetType (ClassType::* func)(const MsgType&), ClassType* obj, SubscribeOptions options = {}) {
+        return Register(false, MemberSubscriber<MsgType>(func, obj, options));
+    }
+
+    template<typename MsgType, typename RetType, typename ClassType>
+    BASE_OF_T(MsgType, Subscription) Subscribe(RetType (ClassType::* func)(MsgType), ClassType* obj, SubscribeOptions options = {}) {
+        return Register(false, MemberSubscriber<MsgType>(func, obj, options));
     }
 
     template<typename MsgType, typename Function>
-    BASE_OF(MsgType) Subscribe(Function&& func) {
-        Register(false, typeid(MsgType), [func](const std::any& msg) {
-            const MsgType& _msg = std::any_cast<const MsgType&>(msg);
-            func(_msg);
-        }, reinterpret_cast<uint64_t>(func), nullptr);
+    BASE_OF_T(MsgType, Subscription) Subscribe(Function&& func, SubscribeOptions options = {}) {
+        return Register(false, Subscriber {
+            MessageTypeId<MsgType>(),
+            [func = std::forward<Function>(func)](void* msg, bool) {
+                func(*static_cast<const MsgType*>(msg));
+            },
+            0,
+            nullptr,
+            options
+        });
+    }
+
+    // Publishes req to the responders of Req for Resp; the first answer
+    // completes the reply. Pending replies time out after timeout, zero
+    // waits for good. When every correlation slot is in use the reply
+    // comes back already cancelled.
+    template<typename Req, typename Resp>
+    BASE_OF_T(Req, Reply<Resp>) Request(Req req, std::chrono::milliseconds timeout = std::chrono::seconds(5)) {
+        const uint64_t id = ReplyTable<Resp>::Instance().Acquire();
+        if (!id)
+            return Reply<Resp>();
+
+        Reply<Resp> reply(id);
+        if (timeout.count() > 0)
+            ReplyTimer::Instance().Schedule(std::chrono::steady_clock::now() + timeout, &ReplyTable<Resp>::Expire, id);
+
+        RequestMessage<Req, Resp> msg;
+        msg.request = std::move(req);
+        msg.correlation = id;
+        Publish(std::move(msg));
+        return reply;
+    }
+
+    // fn(const Req&) returns the Resp, or fn(const Req&, Responder<Resp>)
+    // answers through the responder whenever it is ready. options apply as
+    // for Subscribe, so a responder may run on its own thread.
+    template<typename Req, typename Resp, typename Function>
+    BASE_OF_T(Req, Subscription) Respond(Function&& fn, SubscribeOptions options = {}) {
+        using Envelope = RequestMessage<Req, Resp>;
+        return Subscribe<Envelope>([fn = std::forward<Function>(fn)](const Envelope& msg) {
+            Responder<Resp> responder(msg.correlation);
+            if constexpr (std::is_invocable<const Function&, const Req&, Responder<Resp>>::value)
+                fn(msg.request, responder);
+            else if (responder.Pending())
+                responder.Send(fn(msg.request));
+        }, options);
+    }
+
+    template<typename MsgType, typename RetType, typename ClassType>
+    BASE_OF_T(MsgType, Subscription) SubscribeUnique(RetType (ClassType::* func)(const MsgType&), ClassType* obj, SubscribeOptions options = {}) {
+        return Register(true, MemberSubscriber<MsgType>(func, obj, options));
     }
 
     template<typename MsgType, typename RetType, typename ClassType>
-    BASE_OF(MsgType) SubscribeUnique(RetType (ClassType::* func)(MsgType), ClassType* obj) {
-        Register(true, typeid(MsgType), [func, obj](const std::any& msg) {
-            MsgType _msg = std::any_cast<MsgType>(msg);
-            (obj->*func)(_msg);
-        }, reinterpret_cast<uint64_t>(func), static_cast<void*>(obj));
+    BASE_OF_T(MsgType, Subscription) SubscribeUnique(RetType (ClassType::* func)(MsgType), ClassType* obj, SubscribeOptions options = {}) {
+        return Register(true, MemberSubscriber<MsgType>(func, obj, options));
+    }
+
+    // Conflate every queued subscription of MsgType, not just the ones that
+    // ask for it. With a merge function pending values are folded together
+    // instead of the newest one winning.
+    template<typename MsgType>
+    BASE_OF(MsgType) SetConflation(bool enable, std::function<void(MsgType& pending, const MsgType& incoming)> merge = {}) {
+        Merge _merge;
+        if (merge) {
+            _merge = [merge = std::move(merge)](void* pending, const void* incoming) {
+                merge(*static_cast<MsgType*>(pending), *static_cast<const MsgType*>(incoming));
+            };
+        }
+        SetConflation(MessageTypeId<MsgType>(), enable, std::move(_merge));
     }
 
+    template<typename MsgType>
+    ConflationStats Conflation() const {
+        return Conflation(MessageTypeId<MsgType>());
+    }
+
+    // Keep the last MsgType published and hand it to each new subscriber of
+    // MsgType or its bases as it subscribes, so late subscribers start from
+    // the current state. Disabling drops the cached value.
+    template<typename MsgType>
+    BASE_OF(MsgType) SetSticky(bool enable) {
+        SetSticky(MessageTypeId<MsgType>(), enable);
+    }
+
+    // Stamp every MsgType published with a sequence number, ordering it
+    // against all other sequenced and sticky types. Off by default: the
+    // counter is one cache line every sequenced publish, on any thread,
+    // writes to.
+    template<typename MsgType>
+    BASE_OF(MsgType) SetSequenced(bool enable) {
+        SetSequenced(MessageTypeId<MsgType>(), enable);
+    }
+
+    // The cached value of a sticky MsgType, or nullptr before its first
+    // publish. Doesn't subscribe and never blocks a publisher.
+    template<typename MsgType>
+    BASE_OF_T(MsgType, std::shared_ptr<const MsgType>) LastValue() const {
+        return std::static_pointer_cast<const MsgType>(LastValue(MessageTypeId<MsgType>()));
+    }
+
+    // Applies to every receiver thread. Weights are per lane, High first;
+    // they only matter for Scheduling::Weighted.
+    void SetScheduling(Scheduling scheduling, std::array<uint32_t, kPriorityLanes> weights = { 8, 4, 1 });
+
+    // Per-lane queue depth and wait times of every receiver thread.
+    std::vector<ReceiverStats> QueueStats() const;
+
+    // Times every handler call and counts publishes per type while enabled.
+    // Building with LLMMSG_NO_METRICS compiles it out; snapshots are then
+    // empty.
+    void SetInstrumentation(bool enable);
+
+    // Handler calls taking longer than budget emit SigSlowSubscriber from
+    // the thread that ran them. Zero turns the check off.
+    void SetSlowSubscriberBudget(std::chrono::nanoseconds budget);
+
+    // Counters are cumulative and read without stopping publishers.
+    MetricsSnapshot Metrics();
+
+    // Registers how keyed subscriptions to MsgType are routed: key(msg)
+    // returns a hashable, equality-comparable value, and Publish invokes
+    // only the subscribers whose SubscribeOptions::key matches it, plus
+    // every unkeyed one.
+    template<typename MsgType, typename Function>
+    BASE_OF(MsgType) SetRoutingKey(Function&& key) {
+        using Key = std::decay_t<std::invoke_result_t<Function, const MsgType&>>;
+        auto _key = std::make_shared<std::decay_t<Function>>(std::forward<Function>(key));
+        SetRoutingKey(MessageTypeId<MsgType>(), Router {
+            &typeid(Key),
+            [_key](const void* msg, KeyVisitor visit, void* context) {
+                const Key key = (*_key)(*static_cast<const MsgType*>(msg));
+                visit(context, std::hash<Key>()(key), &key);
+            },
+            [](const void* key, const void* value) {
+                return *static_cast<const Key*>(key) == *static_cast<const Key*>(value);
+            }
+        });
+    }
+
+signals:
+    void SigSlowSubscriber(const QString& type, QObject* context, qint64 elapsed_ns);
+
 private:
-    void Distribute(std::type_index type, std::any&& msg);
-    void Register(bool unique, std::type_index type, std::function<void(std::any)>&& cb, uint64_t func, void* obj);
+    // The sequence, if the type has one, is stamped by Distribute.
+    void Stamp(Message& msg) {
+        msg.timestamp_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+        msg.sequence_ = 0;
+    }
+
+    // msg always points at a MsgType: the type is fixed when the callback
+    // is built, so nothing is checked per delivery. movable is set when the
+    // handler is the last one to see an rvalue message, so a by-value
+    // handler may take it over instead of copying.
+    using Callback = std::function<void(void* msg, bool movable)>;
+    using Copier = std::shared_ptr<const void> (*)(void* msg, bool movable);
+    using Merge = std::function<void(void* pending, const void* incoming)>;
+
+    // route computes msg's key once and hands it to visit with its hash;
+    // equal compares two keys of the router's type.
+    using KeyVisitor = void (*)(void* context, size_t hash, const void* key);
+    struct Router {
+        const std::type_info* type;
+        std::function<void(const void* msg, KeyVisitor visit, void* context)> route;
+        bool (*equal)(const void* key, const void* value);
+    };
+
+    struct Subscriber {
+        size_t type;
+        Callback cb;
+        uint64_t func;
+        void* receiver;
+        SubscribeOptions options;
+    };
+
+    template<typename MsgType>
+    static std::shared_ptr<const void> CopyMessage(void* msg, bool movable) {
+        MsgType& _msg = *static_cast<MsgType*>(msg);
+        if (movable)
+            return MakeMessage<MsgType>(std::move(_msg));
+        return MakeMessage<MsgType>(_msg);
+    }
+
+    template<typename MsgType, typename Func, typename ClassType>
+    static Subscriber MemberSubscriber(Func func, ClassType* obj, SubscribeOptions options) {
+        if constexpr (std::is_base_of<QObject, ClassType>::value) {
+            if (!options.context)
+                options.context = obj;
+        }
+        return Subscriber {
+            MessageTypeId<MsgType>(),
+            MemberCallback<MsgType>(func, obj),
+            FuncId(func),
+            static_cast<void*>(obj),
+            options
+        };
+    }
+
+    template<typename MsgType, typename RetType, typename ClassType>
+    static Callback MemberCallback(RetType (ClassType::* func)(const MsgType&), ClassType* obj) {
+        return [func, obj](void* msg, bool) {
+            (obj->*func)(*static_cast<const MsgType*>(msg));
+        };
+    }
+
+    template<typename MsgType, typename RetType, typename ClassType>
+    static Callback MemberCallback(RetType (ClassType::* func)(MsgType), ClassType* obj) {
+        return [func, obj](void* msg, bool movable) {
+            MsgType& _msg = *static_cast<MsgType*>(msg);
+            if (movable)
+                (obj->*func)(std::move(_msg));
+            else
+                (obj->*func)(_msg);
+        };
+    }
+
+    // Member function pointers can't be cast to an integer, fold their
+    // bytes instead so SubscribeUnique can tell handlers apart.
+    template<typename Func>
+    static uint64_t FuncId(Func func) {
+        unsigned char bytes[sizeof(Func)];
+        std::memcpy(bytes, &func, sizeof(Func));
+        uint64_t hash = 14695981039346656037ull;
+        for (unsigned char byte : bytes)
+            hash = (hash ^ byte) * 1099511628211ull;
+        return hash;
+    }
+
+    void Distribute(size_t type, void* msg, bool movable, Copier copier, const Lineage& lineage, Completion completion);
+    Subscription Register(bool unique, Subscriber&& subscriber);
+    void Unsubscribe(const std::shared_ptr<SubscriptionState>& state);
+    void SetConflation(size_t type, bool enable, Merge&& merge);
+    ConflationStats Conflation(size_t type) const;
+    void SetRoutingKey(size_t type, Router&& router);
+    void SetSticky(size_t type, bool enable);
+    void SetSequenced(size_t type, bool enable);
+    std::shared_ptr<const void> LastValue(size_t type) const;
+
+    friend class Subscription;
 
     explicit MessageCenter();
     ~MessageCenter();
@@ -1,7 +1,29 @@
+# Uncomment to compile out handler timing and publish counting; see
+# MessageCenter::SetInstrumentation.
+#DEFINES += LLMMSG_NO_METRICS
+
 HEADERS += \
+    $$PWD/EpochDomain.h \
     $$PWD/MessageCenter.h \
+    $$PWD/MessageCodec.h \
     $$PWD/MessageConst.h \
+    $$PWD/MessageJournal.h \
+    $$PWD/MessagePool.h \
+    $$PWD/MessageReply.h \
+    $$PWD/SharedMemoryBridge.h \
+    $$PWD/WorkStealingPool.h
 
 SOURCES += \
+    $$PWD/EpochDomain.cpp \
     $$PWD/MessageCenter.cpp \
-    $$PWD/MessageConst.cpp
+    $$PWD/MessageCodec.cpp \
+    $$PWD/MessageJournal.cpp \
+    $$PWD/MessageReply.cpp \
+    $$PWD/SharedMemoryBridge.cpp \
+    $$PWD/WorkStealingPool.cpp
+
+# The QML bridge, for projects that use Qt Quick.
+contains(QT, quick) {
+    HEADERS += $$PWD/QmlMessageBridge.h
+    SOURCES += $$PWD/QmlMessageBridge.cpp
+}
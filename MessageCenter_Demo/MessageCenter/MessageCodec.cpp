@@ -0,0 +1,73 @@
+#include <QDebug>
+
+#include "MessageCodec.h"
+
+namespace lilaomo {
+
+std::shared_ptr<const MessageCodec> CodecRegistry::Find(uint64_t id) const {
+    std::unique_lock<std::mutex> ulock(mtx_);
+    auto iter = by_id_.find(id);
+    return iter != by_id_.end() ? iter->second : nullptr;
+}
+
+
+
+std::shared_ptr<const MessageCodec> CodecRegistry::FindType(size_t type) const {
+    std::unique_lock<std::mutex> ulock(mtx_);
+    auto iter = by_type_.find(type);
+    return iter != by_type_.end() ? iter->second : nullptr;
+}
+
+
+
+std::vector<std::shared_ptr<const MessageCodec>> CodecRegistry::All() const {
+    std::unique_lock<std::mutex> ulock(mtx_);
+    std::vector<std::shared_ptr<const MessageCodec>> codecs;
+    codecs.reserve(by_type_.size());
+    for (const auto& entry : by_type_)
+        codecs.push_back(entry.second);
+    return codecs;
+}
+
+
+
+uint64_t CodecRegistry::Id(const char* name) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const char* c = name; *c; ++c)
+        hash = (hash ^ static_cast<unsigned char>(*c)) * 1099511628211ull;
+    return hash;
+}
+
+
+
+// Registering a type again replaces its codec; a name already taken by
+// another type is refused, since the wire couldn't tell them apart.
+void CodecRegistry::Add(const char* name, size_t type,
+                        std::function<void(const void*, QByteArray&)>&& encode,
+                        std::function<bool(const char*, size_t, const MessageCodec::Sink&)>&& decode,
+                        void (*publish)(void*),
+                        Subscription (*subscribe)(MessageCodec::Tap)) {
+    auto codec = std::make_shared<MessageCodec>();
+    codec->name = QByteArray(name);
+    codec->id = Id(name);
+    codec->type = type;
+    codec->encode = std::move(encode);
+    codec->decode = std::move(decode);
+    codec->publish = publish;
+    codec->subscribe = subscribe;
+
+    std::unique_lock<std::mutex> ulock(mtx_);
+    auto iter = by_id_.find(codec->id);
+    if (iter != by_id_.end() && iter->second->type != type) {
+        qWarning() << "CodecRegistry: codec name" << name << "is already used by" << MessageTypeName(iter->second->type);
+        return;
+    }
+
+    auto old = by_type_.find(type);
+    if (old != by_type_.end())
+        by_id_.erase(old->second->id);
+    by_id_[codec->id] = codec;
+    by_type_[type] = codec;
+}
+
+}
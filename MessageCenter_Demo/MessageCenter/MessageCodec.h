@@ -0,0 +1,126 @@
+#ifndef MESSAGECODEC_H
+#define MESSAGECODEC_H
+
+#define LLMCODEC lilaomo::CodecRegistry::Instance()
+
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <QByteArray>
+
+#include "MessageCenter.h"
+
+namespace lilaomo {
+
+// Wire format of one message type, shared by every process and recording
+// that uses the same name. Senders and message centers only ever see the
+// type id; the name's hash identifies the type on the wire.
+struct MessageCodec {
+    using Sink = std::function<void(void* msg)>;
+    using Tap = std::function<void(const void* msg, const Message& header)>;
+
+    QByteArray name;
+    uint64_t id = 0;
+    size_t type = 0;
+    // Replaces out's contents with the encoding of msg, a MsgType.
+    std::function<void(const void* msg, QByteArray& out)> encode;
+    // Rebuilds a MsgType and passes it to sink for as long as the call
+    // lasts; false if the data is malformed.
+    std::function<bool(const char* data, size_t size, const Sink& sink)> decode;
+    // Publishes a decoded message through LLMMSG, moving from it.
+    void (*publish)(void* msg) = nullptr;
+    // Subscribes tap to every MsgType published through LLMMSG, for
+    // consumers that only know the codec.
+    Subscription (*subscribe)(Tap tap) = nullptr;
+};
+
+class CodecRegistry {
+public:
+    static CodecRegistry* Instance() {
+        static CodecRegistry _this;
+        return &_this;
+    }
+
+    // Bitwise encoding. Sender is dropped on decode; the deadline stays
+    // valid between processes on the same machine.
+    template<typename MsgType>
+    BASE_OF(MsgType) Register(const char* name) {
+        static_assert(std::is_trivially_copyable<MsgType>::value,
+                      "register an encoder and a decoder for types that aren't trivially copyable");
+        Add(name, MessageTypeId<MsgType>(),
+            [](const void* msg, QByteArray& out) {
+                out.resize(sizeof(MsgType));
+                std::memcpy(out.data(), msg, sizeof(MsgType));
+            },
+            [](const char* data, size_t size, const MessageCodec::Sink& sink) {
+                if (size != sizeof(MsgType))
+                    return false;
+
+                MsgType msg;
+                std::memcpy(static_cast<void*>(&msg), data, sizeof(MsgType));
+                msg.SetSender(nullptr);
+                sink(&msg);
+                return true;
+            },
+            &PublishMessage<MsgType>, &SubscribeMessage<MsgType>);
+    }
+
+    // encode(const MsgType&, QByteArray&) replaces the buffer's contents;
+    // decode(const char*, size_t, MsgType&) returns false on bad data.
+    template<typename MsgType, typename Encode, typename Decode>
+    BASE_OF(MsgType) Register(const char* name, Encode&& encode, Decode&& decode) {
+        Add(name, MessageTypeId<MsgType>(),
+            [encode = std::forward<Encode>(encode)](const void* msg, QByteArray& out) {
+                encode(*static_cast<const MsgType*>(msg), out);
+            },
+            [decode = std::forward<Decode>(decode)](const char* data, size_t size, const MessageCodec::Sink& sink) {
+                MsgType msg;
+                if (!decode(data, size, msg))
+                    return false;
+
+                sink(&msg);
+                return true;
+            },
+            &PublishMessage<MsgType>, &SubscribeMessage<MsgType>);
+    }
+
+    std::shared_ptr<const MessageCodec> Find(uint64_t id) const;
+    std::shared_ptr<const MessageCodec> FindType(size_t type) const;
+    std::vector<std::shared_ptr<const MessageCodec>> All() const;
+
+    // FNV-1a of the name, the same in every process.
+    static uint64_t Id(const char* name);
+
+private:
+    template<typename MsgType>
+    static void PublishMessage(void* msg) {
+        LLMMSG->Publish(std::move(*static_cast<MsgType*>(msg)));
+    }
+
+    template<typename MsgType>
+    static Subscription SubscribeMessage(MessageCodec::Tap tap) {
+        return LLMMSG->Subscribe<MsgType>([tap = std::move(tap)](const MsgType& msg) {
+            tap(&msg, msg);
+        });
+    }
+
+    void Add(const char* name, size_t type,
+             std::function<void(const void*, QByteArray&)>&& encode,
+             std::function<bool(const char*, size_t, const MessageCodec::Sink&)>&& decode,
+             void (*publish)(void*),
+             Subscription (*subscribe)(MessageCodec::Tap));
+
+    CodecRegistry() = default;
+
+private:
+    mutable std::mutex mtx_;
+    std::unordered_map<uint64_t, std::shared_ptr<const MessageCodec>> by_id_;
+    std::unordered_map<size_t, std::shared_ptr<const MessageCodec>> by_type_;
+};
+
+}
+
+#endif // MESSAGECODEC_H
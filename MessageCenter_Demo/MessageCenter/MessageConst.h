@@ -1,28 +1,55 @@
 #ifndef MESSAGECONST_H
 #define MESSAGECONST_H
 
+#include <chrono>
+#include <cstdint>
 #include <QObject>
 
 namespace lilaomo {
 
+// Metadata lives inline so that constructing or copying a message never
+// allocates; a message whose payload is trivially copyable stays so.
+// Timestamp and sequence are stamped by MessageCenter::Publish.
 struct Message {
-    Message();
-    Message(const Message& other);
-    Message(Message&& other);
-    virtual ~Message();
-
-    void operator=(const Message& other);
-    void operator=(Message&& other);
-
-    QObject* Sender() const;
+    QObject* Sender() const { return sender_; }
+    void SetSender(QObject* sender) { sender_ = sender; }
+
+    // steady_clock nanoseconds at publish time
+    int64_t Timestamp() const { return timestamp_; }
+    // Publish order across all types; 0 unless the type is sticky or
+    // sequenced (see MessageCenter::SetSequenced).
+    uint64_t Sequence() const { return sequence_; }
+
+    // Queued deliveries still waiting past the deadline are dropped
+    // instead of dispatched; 0 means no deadline.
+    int64_t Deadline() const { return deadline_; }
+    void SetDeadline(std::chrono::steady_clock::time_point deadline) {
+        deadline_ = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+    }
 
 private:
-    class MessageImpl;
-    using ImplType = std::unique_ptr<MessageImpl>;
+    friend class MessageCenter;
 
-    ImplType impl_;
+    QObject* sender_ = nullptr;
+    int64_t timestamp_ = 0;
+    uint64_t sequence_ = 0;
+    int64_t deadline_ = 0;
+};
+
+// Immediate base of a message type in the dispatch hierarchy. Anything not
+// declared otherwise derives straight from Message; declare deeper chains
+// with LLMMSG_BASE so base-type subscribers also see derived messages.
+template<typename MsgType>
+struct MessageBase {
+    using type = Message;
 };
 
 }
 
+#define LLMMSG_BASE(Msg, Base) \
+    template<> struct lilaomo::MessageBase<Msg> { \
+        static_assert(std::is_base_of<Base, Msg>::value, #Msg " must derive from " #Base); \
+        using type = Base; \
+    };
+
 #endif // MESSAGECONST_H
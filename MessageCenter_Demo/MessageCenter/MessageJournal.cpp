@@ -0,0 +1,611 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+
+#include "MessageCodec.h"
+#include "MessageJournal.h"
+#include "MessagePool.h"
+
+namespace lilaomo {
+
+namespace {
+
+constexpr uint32_t kJournalMagic = 0x4c4c4d4a;
+constexpr uint32_t kJournalVersion = 1;
+constexpr size_t kRecordAlign = 8;
+constexpr size_t kMinSegment = 64 << 10;
+constexpr size_t kMaxQueued = 1 << 16;
+const char* const kSegmentSuffix = ".llmj";
+
+struct SegmentHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t index;
+    int64_t created;        // system_clock milliseconds
+    uint64_t session;       // same for every segment of one Open
+};
+
+// Records follow the segment header back to back. A segment is mapped
+// zeroed, so a record length of 0 marks the end of one left unfinished.
+struct RecordHeader {
+    uint32_t length;        // whole record, multiple of kRecordAlign
+    uint32_t size;          // encoded message
+    uint64_t codec;
+    int64_t timestamp;      // steady_clock nanoseconds at publish time
+    uint64_t sequence;
+};
+
+static_assert(sizeof(SegmentHeader) % kRecordAlign == 0 && sizeof(RecordHeader) % kRecordAlign == 0,
+              "records are laid out in kRecordAlign units");
+
+size_t AlignRecord(size_t size) {
+    return (size + kRecordAlign - 1) & ~(kRecordAlign - 1);
+}
+
+// Zero-padded, so that name order is recording order.
+QString SegmentName(uint64_t index) {
+    return QStringLiteral("%1").arg(index, 8, 10, QLatin1Char('0')) + kSegmentSuffix;
+}
+
+QStringList Segments(const QDir& dir) {
+    return dir.entryList(QStringList() << QString("*") + kSegmentSuffix, QDir::Files, QDir::Name);
+}
+
+struct JournalEntry {
+    JournalEntry* next = nullptr;
+    uint64_t codec = 0;
+    int64_t timestamp = 0;
+    uint64_t sequence = 0;
+    QByteArray payload;
+};
+
+using EntryPool = BlockPool<sizeof(JournalEntry), alignof(JournalEntry)>;
+
+}
+
+
+
+// Multi-producer list of encoded messages for the writer thread. Recorded
+// subscriptions hold it too, so publishes still in flight when the
+// recorder closes push onto a live list.
+class JournalQueue {
+public:
+    ~JournalQueue() {
+        Free(head_.exchange(nullptr, std::memory_order_acquire));
+    }
+
+    // Encodes on the publishing thread; never waits for the writer.
+    void Push(const MessageCodec& codec, const void* msg, const Message& header) {
+        if (queued_.fetch_add(1, std::memory_order_relaxed) >= kMaxQueued) {
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        auto entry = new (EntryPool::Instance().Acquire()) JournalEntry();
+        entry->codec = codec.id;
+        entry->timestamp = header.Timestamp();
+        entry->sequence = header.Sequence();
+        codec.encode(msg, entry->payload);
+
+        JournalEntry* head = head_.load(std::memory_order_relaxed);
+        do {
+            entry->next = head;
+        } while (!head_.compare_exchange_weak(head, entry, std::memory_order_release, std::memory_order_relaxed));
+
+        // Only the push onto an empty list can find the writer asleep.
+        if (!head) {
+            { std::unique_lock<std::mutex> ulock(mtx_); }
+            cv_.notify_one();
+        }
+    }
+
+    // Blocks until entries arrive and takes them all, in timestamp order.
+    // False once stopped with nothing left.
+    bool Take(std::vector<JournalEntry*>& batch) {
+        JournalEntry* list;
+        {
+            std::unique_lock<std::mutex> ulock(mtx_);
+            cv_.wait(ulock, [this]() {
+                return stop_ || head_.load(std::memory_order_acquire);
+            });
+            list = head_.exchange(nullptr, std::memory_order_acquire);
+        }
+        if (!list)
+            return false;
+
+        // The list is newest first; a stable sort by timestamp keeps the
+        // push order of one thread's messages stamped in the same tick.
+        batch.clear();
+        for (; list; list = list->next)
+            batch.push_back(list);
+        std::reverse(batch.begin(), batch.end());
+        std::stable_sort(batch.begin(), batch.end(), [](const JournalEntry* a, const JournalEntry* b) {
+            return a->timestamp < b->timestamp;
+        });
+        return true;
+    }
+
+    void Free(JournalEntry* entry) {
+        while (entry) {
+            JournalEntry* next = entry->next;
+            entry->~JournalEntry();
+            EntryPool::Instance().Release(entry);
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            entry = next;
+        }
+    }
+
+    void Stop() {
+        {
+            std::unique_lock<std::mutex> ulock(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_one();
+    }
+
+public:
+    std::atomic<uint64_t> recorded { 0 };
+    std::atomic<uint64_t> dropped { 0 };
+    std::atomic<uint64_t> bytes { 0 };
+    std::atomic<uint64_t> segments { 0 };
+
+private:
+    std::atomic<JournalEntry*> head_ { nullptr };
+    std::atomic<size_t> queued_ { 0 };
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+};
+
+
+
+class JournalRecorder::JournalRecorderImpl {
+public:
+    JournalRecorderImpl(const QString& directory, size_t segment_size)
+        : dir_(directory)
+        , segment_size_(std::max(AlignRecord(segment_size), kMinSegment))
+    {
+
+    }
+
+    ~JournalRecorderImpl() {
+        Close();
+    }
+
+    bool Open() {
+        if (queue_)
+            return true;
+
+        if (!dir_.mkpath(QStringLiteral("."))) {
+            qWarning() << "JournalRecorder: cannot create" << dir_.path();
+            return false;
+        }
+
+        // Timestamps are steady_clock readings of the recording process,
+        // so they only compare within a session.
+        session_ = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count());
+        index_ = 0;
+        const QStringList existing = Segments(dir_);
+        if (!existing.isEmpty()) {
+            const QString& last = existing.last();
+            index_ = last.left(last.size() - static_cast<int>(std::strlen(kSegmentSuffix))).toULongLong() + 1;
+        }
+
+        queue_ = std::make_shared<JournalQueue>();
+        writer_ = std::thread([this, queue = queue_]() {
+            Write(*queue);
+        });
+        return true;
+    }
+
+    void Close() {
+        if (!queue_)
+            return;
+
+        for (Subscription& subscription : subscriptions_)
+            subscription.Cancel();
+        subscriptions_.clear();
+        recorded_types_.clear();
+
+        queue_->Stop();
+        writer_.join();
+        stats_ = Snapshot(*queue_);
+        queue_.reset();
+    }
+
+    bool Record(size_t type) {
+        if (!queue_) {
+            qWarning() << "JournalRecorder: record" << MessageTypeName(type) << "after Open";
+            return false;
+        }
+
+        std::shared_ptr<const MessageCodec> codec = LLMCODEC->FindType(type);
+        if (!codec) {
+            qWarning() << "JournalRecorder: no codec registered for" << MessageTypeName(type);
+            return false;
+        }
+        if (!recorded_types_.insert(type).second)
+            return true;
+
+        subscriptions_.push_back(codec->subscribe([queue = queue_, codec](const void* msg, const Message& header) {
+            queue->Push(*codec, msg, header);
+        }));
+        return true;
+    }
+
+    size_t RecordAll() {
+        size_t count = 0;
+        for (const auto& codec : LLMCODEC->All()) {
+            if (Record(codec->type))
+                ++count;
+        }
+        return count;
+    }
+
+    JournalStats Stats() const {
+        return queue_ ? Snapshot(*queue_) : stats_;
+    }
+
+private:
+    static JournalStats Snapshot(const JournalQueue& queue) {
+        return JournalStats {
+            queue.recorded.load(std::memory_order_relaxed),
+            queue.dropped.load(std::memory_order_relaxed),
+            queue.bytes.load(std::memory_order_relaxed),
+            queue.segments.load(std::memory_order_relaxed)
+        };
+    }
+
+    void Write(JournalQueue& queue) {
+        std::vector<JournalEntry*> batch;
+        while (queue.Take(batch)) {
+            for (JournalEntry* entry : batch) {
+                Append(queue, *entry);
+                entry->next = nullptr;
+                queue.Free(entry);
+            }
+        }
+        Seal();
+    }
+
+    void Append(JournalQueue& queue, const JournalEntry& entry) {
+        const size_t length = AlignRecord(sizeof(RecordHeader) + entry.payload.size());
+        if (length > segment_size_ - sizeof(SegmentHeader)
+                || ((!map_ || used_ + length > segment_size_) && !Rotate(queue))) {
+            queue.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        const RecordHeader header {
+            static_cast<uint32_t>(length),
+            static_cast<uint32_t>(entry.payload.size()),
+            entry.codec,
+            entry.timestamp,
+            entry.sequence
+        };
+        uchar* record = map_ + used_;
+        std::memcpy(record + sizeof(header), entry.payload.constData(), entry.payload.size());
+        std::memcpy(record, &header, sizeof(header));
+        used_ += length;
+
+        queue.recorded.fetch_add(1, std::memory_order_relaxed);
+        queue.bytes.fetch_add(length, std::memory_order_relaxed);
+    }
+
+    bool Rotate(JournalQueue& queue) {
+        Seal();
+
+        file_.setFileName(dir_.filePath(SegmentName(index_)));
+        if (!file_.open(QIODevice::ReadWrite | QIODevice::Truncate)
+                || !file_.resize(static_cast<qint64>(segment_size_))
+                || !(map_ = file_.map(0, static_cast<qint64>(segment_size_)))) {
+            qWarning() << "JournalRecorder:" << file_.fileName() << file_.errorString();
+            file_.close();
+            return false;
+        }
+
+        const SegmentHeader header {
+            kJournalMagic,
+            kJournalVersion,
+            index_,
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count(),
+            session_
+        };
+        std::memcpy(map_, &header, sizeof(header));
+        used_ = sizeof(header);
+        ++index_;
+        queue.segments.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Unmaps the current segment and trims it to the records written.
+    void Seal() {
+        if (!map_)
+            return;
+
+        file_.unmap(map_);
+        map_ = nullptr;
+        file_.resize(static_cast<qint64>(used_));
+        file_.close();
+    }
+
+private:
+    QDir dir_;
+    const size_t segment_size_;
+    std::shared_ptr<JournalQueue> queue_;
+    std::thread writer_;
+    std::vector<Subscription> subscriptions_;
+    std::unordered_set<size_t> recorded_types_;
+    JournalStats stats_;
+
+    // writer thread only
+    QFile file_;
+    uchar* map_ = nullptr;
+    size_t used_ = 0;
+    uint64_t index_ = 0;
+    uint64_t session_ = 0;
+};
+
+
+
+class JournalReplay::JournalReplayImpl {
+public:
+    JournalReplayImpl(JournalReplay* replay, const QString& directory)
+        : replay_(replay)
+        , dir_(directory)
+    {
+
+    }
+
+    ~JournalReplayImpl() {
+        Stop();
+        Wait();
+    }
+
+    bool Start(double speed) {
+        if (running_.load(std::memory_order_acquire))
+            return false;
+        Wait();
+
+        const QStringList segments = Segments(dir_);
+        if (segments.isEmpty()) {
+            qWarning() << "JournalReplay: no segments in" << dir_.path();
+            return false;
+        }
+
+        stop_ = false;
+        published_.store(0, std::memory_order_relaxed);
+        skipped_.store(0, std::memory_order_relaxed);
+        running_.store(true, std::memory_order_release);
+        player_ = std::thread([this, segments, speed]() {
+            Play(segments, speed);
+            running_.store(false, std::memory_order_release);
+            emit replay_->SigReplayFinished();
+        });
+        return true;
+    }
+
+    void Stop() {
+        {
+            std::unique_lock<std::mutex> ulock(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+    }
+
+    void Wait() {
+        if (player_.joinable())
+            player_.join();
+    }
+
+    ReplayStats Stats() const {
+        return ReplayStats {
+            published_.load(std::memory_order_relaxed),
+            skipped_.load(std::memory_order_relaxed)
+        };
+    }
+
+private:
+    // Each recording session is paced from its own first record; the next
+    // one follows without a gap.
+    void Play(const QStringList& segments, double speed) {
+        auto start = std::chrono::steady_clock::now();
+        bool first = true;
+        int64_t origin = 0;
+        uint64_t session = 0;
+        for (const QString& name : segments) {
+            QFile file(dir_.filePath(name));
+            if (!file.open(QIODevice::ReadOnly)) {
+                qWarning() << "JournalReplay:" << file.fileName() << file.errorString();
+                continue;
+            }
+
+            const size_t size = static_cast<size_t>(file.size());
+            uchar* map = size >= sizeof(SegmentHeader) ? file.map(0, file.size()) : nullptr;
+            if (!map)
+                continue;
+
+            SegmentHeader header;
+            std::memcpy(&header, map, sizeof(header));
+            if (header.magic != kJournalMagic || header.version != kJournalVersion) {
+                qWarning() << "JournalReplay: not a journal segment" << file.fileName();
+                file.unmap(map);
+                continue;
+            }
+            if (header.session != session) {
+                session = header.session;
+                first = true;
+            }
+
+            for (size_t offset = sizeof(header); offset + sizeof(RecordHeader) <= size;) {
+                RecordHeader record;
+                std::memcpy(&record, map + offset, sizeof(record));
+                if (record.length == 0 || record.length % kRecordAlign != 0 || record.length > size - offset
+                        || record.size > record.length - sizeof(RecordHeader))
+                    break;
+
+                // Records of concurrent publishers may be a little out of
+                // time order; those go out without waiting.
+                if (speed > 0) {
+                    if (first) {
+                        origin = record.timestamp;
+                        start = std::chrono::steady_clock::now();
+                        first = false;
+                    }
+                    const auto delay = std::chrono::nanoseconds(static_cast<int64_t>((record.timestamp - origin) / speed));
+                    if (Sleep(start + delay)) {
+                        file.unmap(map);
+                        return;
+                    }
+                } else if (Stopped()) {
+                    file.unmap(map);
+                    return;
+                }
+
+                Publish(record.codec, reinterpret_cast<const char*>(map + offset + sizeof(record)), record.size);
+                offset += record.length;
+            }
+            file.unmap(map);
+        }
+    }
+
+    void Publish(uint64_t id, const char* data, size_t size) {
+        auto iter = codecs_.find(id);
+        if (iter == codecs_.end())
+            iter = codecs_.emplace(id, LLMCODEC->Find(id)).first;
+
+        const std::shared_ptr<const MessageCodec>& codec = iter->second;
+        if (!codec || !codec->decode(data, size, [&codec](void* msg) { codec->publish(msg); })) {
+            skipped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        published_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // True if stopped before deadline.
+    bool Sleep(std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> ulock(mtx_);
+        return cv_.wait_until(ulock, deadline, [this]() {
+            return stop_;
+        });
+    }
+
+    bool Stopped() {
+        std::unique_lock<std::mutex> ulock(mtx_);
+        return stop_;
+    }
+
+private:
+    JournalReplay* replay_;
+    QDir dir_;
+    std::thread player_;
+    std::atomic<bool> running_ { false };
+    std::atomic<uint64_t> published_ { 0 };
+    std::atomic<uint64_t> skipped_ { 0 };
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+
+    // player thread only; null for ids without a codec
+    std::unordered_map<uint64_t, std::shared_ptr<const MessageCodec>> codecs_;
+};
+
+
+
+JournalRecorder::JournalRecorder(const QString& directory, size_t segment_size, QObject* parent)
+    : QObject(parent)
+    , impl_(std::make_unique<JournalRecorderImpl>(directory, segment_size))
+{
+
+}
+
+
+
+JournalRecorder::~JournalRecorder() {
+
+}
+
+
+
+bool JournalRecorder::Open() {
+    return impl_->Open();
+}
+
+
+
+void JournalRecorder::Close() {
+    impl_->Close();
+}
+
+
+
+size_t JournalRecorder::RecordAll() {
+    return impl_->RecordAll();
+}
+
+
+
+JournalStats JournalRecorder::Stats() const {
+    return impl_->Stats();
+}
+
+
+
+bool JournalRecorder::Record(size_t type) {
+    return impl_->Record(type);
+}
+
+
+
+JournalReplay::JournalReplay(const QString& directory, QObject* parent)
+    : QObject(parent)
+    , impl_(std::make_unique<JournalReplayImpl>(this, directory))
+{
+
+}
+
+
+
+JournalReplay::~JournalReplay() {
+
+}
+
+
+
+bool JournalReplay::Start(double speed) {
+    return impl_->Start(speed);
+}
+
+
+
+void JournalReplay::Stop() {
+    impl_->Stop();
+}
+
+
+
+void JournalReplay::Wait() {
+    impl_->Wait();
+}
+
+
+
+ReplayStats JournalReplay::Stats() const {
+    return impl_->Stats();
+}
+
+}
@@ -0,0 +1,99 @@
+#ifndef MESSAGEJOURNAL_H
+#define MESSAGEJOURNAL_H
+
+#include <memory>
+#include <QObject>
+
+#include "MessageCenter.h"
+
+namespace lilaomo {
+
+struct JournalStats {
+    uint64_t recorded = 0;
+    uint64_t dropped = 0;       // writer too far behind, or larger than a segment
+    uint64_t bytes = 0;
+    uint64_t segments = 0;
+};
+
+struct ReplayStats {
+    uint64_t published = 0;
+    uint64_t skipped = 0;       // no codec for the type, or undecodable
+};
+
+// Records published messages to a directory of binary segments, each
+// written through a memory mapping and closed once it reaches the segment
+// size. Every record carries the codec id, publish timestamp and sequence
+// number of the message (0 unless its type is sequenced), in the encoding
+// of its codec (see CodecRegistry). Records are written in timestamp order.
+//
+// Publishers only encode the message and push it onto a lock-free queue;
+// one writer thread appends the queue to the journal. Records that would
+// take the queue past its bound are dropped rather than slow the bus down.
+class JournalRecorder : public QObject
+{
+    Q_OBJECT
+    class JournalRecorderImpl;
+    using ImplType = std::unique_ptr<JournalRecorderImpl>;
+
+public:
+    explicit JournalRecorder(const QString& directory, size_t segment_size = 64 << 20, QObject* parent = nullptr);
+    ~JournalRecorder();
+
+    // Starts a new segment after any already in the directory.
+    bool Open();
+    // Stops recording, writes what is queued and trims the last segment.
+    void Close();
+
+    // Records MsgType, which needs a codec; the recorder must be open.
+    template<typename MsgType>
+    BASE_OF_T(MsgType, bool) Record() {
+        return Record(MessageTypeId<MsgType>());
+    }
+
+    // Records every type with a codec registered by now; returns how many.
+    size_t RecordAll();
+
+    JournalStats Stats() const;
+
+private:
+    bool Record(size_t type);
+
+private:
+    ImplType impl_;
+};
+
+// Publishes a recorded journal again, from a thread of its own, with the
+// pacing it was recorded at divided by speed; each recording session (one
+// JournalRecorder::Open) follows the one before without a gap. Messages
+// are stamped anew as they are published; types without a codec in this
+// process are skipped.
+class JournalReplay : public QObject
+{
+    Q_OBJECT
+    class JournalReplayImpl;
+    using ImplType = std::unique_ptr<JournalReplayImpl>;
+
+public:
+    explicit JournalReplay(const QString& directory, QObject* parent = nullptr);
+    ~JournalReplay();
+
+    // speed 1 keeps the original pacing, 10 plays ten times faster and 0
+    // publishes as fast as possible. False if a replay is running or the
+    // directory holds no segments.
+    bool Start(double speed = 1.0);
+    void Stop();
+    // Blocks until the replay ends or is stopped.
+    void Wait();
+
+    ReplayStats Stats() const;
+
+signals:
+    void SigReplayFinished();
+
+private:
+    ImplType impl_;
+};
+
+}
+
+#endif // MESSAGEJOURNAL_H
@@ -0,0 +1,180 @@
+#ifndef MESSAGEPOOL_H
+#define MESSAGEPOOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+
+namespace lilaomo {
+
+// Opt a high-rate message type into pooled storage:
+//   template<> struct PooledMessage<PositionChange> : std::true_type {};
+// MakeMessage then recycles freed blocks instead of going to the heap.
+template<typename MsgType>
+struct PooledMessage : std::false_type {};
+
+// Free list of fixed-size blocks, one per (size, align) pair. Each thread
+// keeps its own cache and takes no lock: a thread that frees more than it
+// allocates spills its cache onto a shared stack, and one that runs dry
+// takes the whole stack at once. Both are a single atomic operation, and
+// taking everything leaves no room for ABA.
+template<size_t Size, size_t Align>
+class BlockPool {
+    static_assert(Size >= sizeof(void*), "a free block holds the link to the next");
+
+public:
+    // Never destroyed: queued calls and pooled messages may still be
+    // released by other singletons' destructors at exit.
+    static BlockPool& Instance() {
+        static BlockPool* pool = new BlockPool();
+        return *pool;
+    }
+
+    void* Acquire() {
+        Cache& cache = Local();
+        if (!cache.head && !cache.closed)
+            Refill(cache);
+        if (!cache.head)
+            return ::operator new(Size, std::align_val_t(Align));
+
+        void* block = cache.head;
+        cache.head = Next(block);
+        if (!cache.head)
+            cache.tail = nullptr;
+        --cache.count;
+        return block;
+    }
+
+    void Release(void* block) {
+        Cache& cache = Local();
+        if (cache.closed) {
+            Spill(block, block, 1);
+            return;
+        }
+
+        Next(block) = cache.head;
+        cache.head = block;
+        if (!cache.tail)
+            cache.tail = block;
+        if (++cache.count >= kLocalMax)
+            Flush(cache);
+    }
+
+private:
+    static constexpr size_t kLocalMax = 64;
+    static constexpr size_t kMaxFree = 1024;
+
+    // Trivially destructible, so it stays usable after the thread's
+    // Closer has run; blocks released then go straight to the stack.
+    struct Cache {
+        void* head;
+        void* tail;
+        size_t count;
+        bool closed;
+    };
+
+    struct Closer {
+        ~Closer() {
+            Instance().Flush(*cache);
+            cache->closed = true;
+        }
+
+        Cache* cache;
+    };
+
+    BlockPool() = default;
+
+    static void*& Next(void* block) {
+        return *static_cast<void**>(block);
+    }
+
+    static Cache& Local() {
+        thread_local Cache cache {};
+        thread_local Closer closer { &cache };
+        return cache;
+    }
+
+    void Refill(Cache& cache) {
+        void* list = shared_.exchange(nullptr, std::memory_order_acquire);
+        if (!list)
+            return;
+
+        size_t count = 1;
+        void* tail = list;
+        for (; Next(tail); tail = Next(tail))
+            ++count;
+        shared_count_.fetch_sub(count, std::memory_order_relaxed);
+        cache.head = list;
+        cache.tail = tail;
+        cache.count = count;
+    }
+
+    void Flush(Cache& cache) {
+        if (cache.head)
+            Spill(cache.head, cache.tail, cache.count);
+        cache.head = cache.tail = nullptr;
+        cache.count = 0;
+    }
+
+    // Past kMaxFree on the stack, blocks go back to the heap instead.
+    void Spill(void* first, void* last, size_t count) {
+        if (shared_count_.load(std::memory_order_relaxed) + count > kMaxFree) {
+            while (first) {
+                void* next = first == last ? nullptr : Next(first);
+                ::operator delete(first, std::align_val_t(Align));
+                first = next;
+            }
+            return;
+        }
+
+        shared_count_.fetch_add(count, std::memory_order_relaxed);
+        void* head = shared_.load(std::memory_order_relaxed);
+        do {
+            Next(last) = head;
+        } while (!shared_.compare_exchange_weak(head, first, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+private:
+    std::atomic<void*> shared_ { nullptr };
+    std::atomic<size_t> shared_count_ { 0 };
+};
+
+template<typename T>
+struct PoolAllocator {
+    using value_type = T;
+
+    PoolAllocator() = default;
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        if (n != 1)
+            return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+        return static_cast<T*>(BlockPool<sizeof(T), alignof(T)>::Instance().Acquire());
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n != 1)
+            return ::operator delete(p, std::align_val_t(alignof(T)));
+        BlockPool<sizeof(T), alignof(T)>::Instance().Release(p);
+    }
+
+    template<typename U>
+    bool operator==(const PoolAllocator<U>&) const { return true; }
+    template<typename U>
+    bool operator!=(const PoolAllocator<U>&) const { return false; }
+};
+
+// Shared message storage for anything that has to outlive Publish.
+template<typename MsgType, typename... Args>
+std::shared_ptr<MsgType> MakeMessage(Args&&... args) {
+    if constexpr (PooledMessage<MsgType>::value)
+        return std::allocate_shared<MsgType>(PoolAllocator<MsgType>(), std::forward<Args>(args)...);
+    else
+        return std::make_shared<MsgType>(std::forward<Args>(args)...);
+}
+
+}
+
+#endif // MESSAGEPOOL_H
@@ -0,0 +1,68 @@
+#include <algorithm>
+#include <functional>
+
+#include "MessageReply.h"
+
+namespace lilaomo {
+
+ReplyTimer& ReplyTimer::Instance() {
+    static ReplyTimer timer;
+    return timer;
+}
+
+
+
+ReplyTimer::~ReplyTimer() {
+    {
+        std::unique_lock<std::mutex> ulock(mtx_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+
+
+// Entries stay queued after their request is answered; expiring a settled
+// or reused slot is a no-op thanks to the generation in the id.
+void ReplyTimer::Schedule(std::chrono::steady_clock::time_point deadline, Expire expire, uint64_t id) {
+    bool earliest;
+    {
+        std::unique_lock<std::mutex> ulock(mtx_);
+        if (!thread_.joinable())
+            thread_ = std::thread(&ReplyTimer::Run, this);
+
+        heap_.push_back(Entry { deadline, expire, id });
+        std::push_heap(heap_.begin(), heap_.end(), std::greater<Entry>());
+        earliest = heap_.front().id == id;
+    }
+    if (earliest)
+        cv_.notify_one();
+}
+
+
+
+void ReplyTimer::Run() {
+    std::unique_lock<std::mutex> ulock(mtx_);
+    while (!stop_) {
+        if (heap_.empty()) {
+            cv_.wait(ulock);
+            continue;
+        }
+
+        const Entry next = heap_.front();
+        if (std::chrono::steady_clock::now() < next.deadline) {
+            cv_.wait_until(ulock, next.deadline);
+            continue;
+        }
+
+        std::pop_heap(heap_.begin(), heap_.end(), std::greater<Entry>());
+        heap_.pop_back();
+        ulock.unlock();
+        next.expire(next.id);
+        ulock.lock();
+    }
+}
+
+}
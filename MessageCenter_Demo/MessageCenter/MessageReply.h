@@ -0,0 +1,483 @@
+#ifndef MESSAGEREPLY_H
+#define MESSAGEREPLY_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define LLMMSG_COROUTINES
+#include <coroutine>
+#endif
+#include <QObject>
+
+#include "MessageConst.h"
+
+namespace lilaomo {
+
+enum class ReplyStatus {
+    Pending,
+    Ready,
+    Timeout,
+    Cancelled
+};
+
+// What MessageCenter::Request publishes: the request and the correlation
+// id its responder completes.
+template<typename Req, typename Resp>
+struct RequestMessage : Message {
+    Req request;
+    uint64_t correlation = 0;
+};
+
+// Settles slots whose deadline passed, from one thread started on first use.
+class ReplyTimer {
+public:
+    using Expire = void (*)(uint64_t id);
+
+    static ReplyTimer& Instance();
+
+    void Schedule(std::chrono::steady_clock::time_point deadline, Expire expire, uint64_t id);
+
+private:
+    struct Entry {
+        std::chrono::steady_clock::time_point deadline;
+        Expire expire;
+        uint64_t id;
+
+        bool operator>(const Entry& other) const {
+            return deadline > other.deadline;
+        }
+    };
+
+    ReplyTimer() = default;
+    ~ReplyTimer();
+
+    void Run();
+
+private:
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::vector<Entry> heap_;
+    std::thread thread_;
+    bool stop_ = false;
+};
+
+// Correlation table for one response type: fixed chunks of reusable slots.
+// An id is the slot's index and generation; a slot's generation and state
+// share one atomic word, so a late or duplicate reply to a slot that was
+// released and reused can never land in the new request.
+template<typename Resp>
+class ReplyTable {
+public:
+    using Callback = std::function<void(ReplyStatus status)>;
+
+    // Never freed: the timer thread may still expire slots at exit.
+    static ReplyTable& Instance() {
+        static ReplyTable* table = new ReplyTable();
+        return *table;
+    }
+
+    // 0 once every slot is taken.
+    uint64_t Acquire() {
+        uint32_t index;
+        {
+            std::unique_lock<std::mutex> ulock(mtx_);
+            if (free_.empty() && !Grow())
+                return 0;
+            index = free_.back();
+            free_.pop_back();
+        }
+        Slot& slot = At(index);
+        const uint64_t word = slot.word.load(std::memory_order_relaxed);
+        const uint32_t generation = static_cast<uint32_t>(word >> kStateBits);
+        slot.word.store(Word(generation, State::Pending), std::memory_order_release);
+        return (uint64_t(generation) << 32) | index;
+    }
+
+    // First settle wins; false if the request is no longer pending.
+    bool Complete(uint64_t id, Resp&& value) {
+        Slot& slot = At(Index(id));
+        if (!Claim(slot, id))
+            return false;
+
+        slot.value.emplace(std::move(value));
+        Settle(slot, id, State::Ready);
+        return true;
+    }
+
+    bool Finish(uint64_t id, ReplyStatus status) {
+        Slot& slot = At(Index(id));
+        if (!Claim(slot, id))
+            return false;
+
+        Settle(slot, id, status == ReplyStatus::Timeout ? State::Timeout : State::Cancelled);
+        return true;
+    }
+
+    static void Expire(uint64_t id) {
+        Instance().Finish(id, ReplyStatus::Timeout);
+    }
+
+    ReplyStatus Status(uint64_t id) const {
+        const uint64_t word = At(Index(id)).word.load(std::memory_order_acquire);
+        if ((word >> kStateBits) != Generation(id))
+            return ReplyStatus::Cancelled;
+        return ToStatus(static_cast<State>(word & kStateMask));
+    }
+
+    ReplyStatus Wait(uint64_t id) {
+        Slot& slot = At(Index(id));
+        std::unique_lock<std::mutex> ulock(slot.mtx);
+        slot.cv.wait(ulock, [this, id]() {
+            return Status(id) != ReplyStatus::Pending;
+        });
+        return Status(id);
+    }
+
+    // Runs callback at once if the request has settled, else on the
+    // thread that settles it.
+    void Then(uint64_t id, Callback&& callback) {
+        if (!Listen(id, callback))
+            callback(Status(id));
+    }
+
+    // Takes callback for the thread that settles the request, unless it
+    // has settled already; false then, and callback is left alone.
+    bool Listen(uint64_t id, Callback& callback) {
+        Slot& slot = At(Index(id));
+        std::unique_lock<std::mutex> ulock(slot.mtx);
+        if (Status(id) != ReplyStatus::Pending)
+            return false;
+
+        slot.callback = std::move(callback);
+        return true;
+    }
+
+    Resp& Value(uint64_t id) {
+        return *At(Index(id)).value;
+    }
+
+    // Calls fn(status, value) if the slot still holds id settled as status;
+    // value is null unless it is Ready. The slot is not reused until fn
+    // returns: a Release meanwhile waits for it, or, made from within fn,
+    // is finished once fn returns.
+    template<typename Function>
+    void Call(uint64_t id, ReplyStatus status, Function& fn) {
+        Slot& slot = At(Index(id));
+        {
+            // Status reads a reused slot as Cancelled, so the generation is
+            // checked on its own.
+            std::unique_lock<std::mutex> ulock(slot.mtx);
+            const uint64_t word = slot.word.load(std::memory_order_acquire);
+            if ((word >> kStateBits) != Generation(id) || ToStatus(static_cast<State>(word & kStateMask)) != status)
+                return;
+            slot.caller = std::this_thread::get_id();
+        }
+        fn(status, status == ReplyStatus::Ready ? &*slot.value : static_cast<Resp*>(nullptr));
+
+        bool released;
+        {
+            std::unique_lock<std::mutex> ulock(slot.mtx);
+            slot.caller = std::thread::id();
+            released = slot.released;
+            slot.released = false;
+            if (released)
+                Recycle(slot, id);
+        }
+        slot.cv.notify_all();
+        if (released)
+            Free(id);
+    }
+
+    // Drops the callback, cancels the request if it is still pending and
+    // recycles the slot once no Call is running on it.
+    void Release(uint64_t id) {
+        Slot& slot = At(Index(id));
+        {
+            std::unique_lock<std::mutex> ulock(slot.mtx);
+            slot.callback = nullptr;
+        }
+        Finish(id, ReplyStatus::Cancelled);
+        while ((slot.word.load(std::memory_order_acquire) & kStateMask) == static_cast<uint64_t>(State::Completing))
+            std::this_thread::yield();
+
+        {
+            std::unique_lock<std::mutex> ulock(slot.mtx);
+            if (slot.caller == std::this_thread::get_id()) {
+                slot.released = true;
+                return;
+            }
+            slot.cv.wait(ulock, [&slot]() {
+                return slot.caller == std::thread::id();
+            });
+            // Under the same lock, so that no Call slips in before the
+            // generation moves on.
+            Recycle(slot, id);
+        }
+        Free(id);
+    }
+
+private:
+    enum class State : uint64_t {
+        Free,
+        Pending,
+        Completing,     // a responder is storing the value
+        Ready,
+        Timeout,
+        Cancelled
+    };
+
+    struct Slot {
+        std::atomic<uint64_t> word { uint64_t(1) << kStateBits };
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::optional<Resp> value;
+        Callback callback;
+        std::thread::id caller;     // thread inside Call, if any
+        bool released = false;      // Release came from within Call
+    };
+
+    static constexpr uint64_t kStateBits = 8;
+    static constexpr uint64_t kStateMask = (uint64_t(1) << kStateBits) - 1;
+    static constexpr uint32_t kChunk = 256;
+    static constexpr uint32_t kMaxChunks = 256;
+
+    ReplyTable() {
+        free_.reserve(kChunk);
+    }
+
+    static uint32_t Index(uint64_t id) { return static_cast<uint32_t>(id); }
+    static uint32_t Generation(uint64_t id) { return static_cast<uint32_t>(id >> 32); }
+
+    static uint64_t Word(uint32_t generation, State state) {
+        return (uint64_t(generation) << kStateBits) | static_cast<uint64_t>(state);
+    }
+
+    static ReplyStatus ToStatus(State state) {
+        switch (state) {
+        case State::Pending:
+        case State::Completing:
+            return ReplyStatus::Pending;
+        case State::Ready:
+            return ReplyStatus::Ready;
+        case State::Timeout:
+            return ReplyStatus::Timeout;
+        default:
+            return ReplyStatus::Cancelled;
+        }
+    }
+
+    Slot& At(uint32_t index) const {
+        return chunks_[index / kChunk].load(std::memory_order_acquire)[index % kChunk];
+    }
+
+    bool Claim(Slot& slot, uint64_t id) {
+        uint64_t expected = Word(Generation(id), State::Pending);
+        return slot.word.compare_exchange_strong(expected, Word(Generation(id), State::Completing), std::memory_order_acq_rel);
+    }
+
+    void Settle(Slot& slot, uint64_t id, State state) {
+        Callback callback;
+        {
+            std::unique_lock<std::mutex> ulock(slot.mtx);
+            slot.word.store(Word(Generation(id), state), std::memory_order_release);
+            callback = std::move(slot.callback);
+            slot.callback = nullptr;
+        }
+        slot.cv.notify_all();
+        if (callback)
+            callback(ToStatus(state));
+    }
+
+    // Clears the slot and bumps the generation; called with slot.mtx held.
+    static void Recycle(Slot& slot, uint64_t id) {
+        slot.value.reset();
+        slot.callback = nullptr;
+        // 0 never comes round so that no id is 0
+        const uint32_t generation = Generation(id) + 1;
+        slot.word.store(Word(generation ? generation : 1, State::Free), std::memory_order_release);
+    }
+
+    void Free(uint64_t id) {
+        std::unique_lock<std::mutex> ulock(mtx_);
+        free_.push_back(Index(id));
+    }
+
+    // Called with mtx_ held.
+    bool Grow() {
+        if (chunks_count_ == kMaxChunks)
+            return false;
+
+        const uint32_t base = chunks_count_ * kChunk;
+        chunks_[chunks_count_].store(new Slot[kChunk], std::memory_order_release);
+        ++chunks_count_;
+        for (uint32_t i = kChunk; i > 0; --i)
+            free_.push_back(base + i - 1);
+        return true;
+    }
+
+private:
+    std::mutex mtx_;
+    std::vector<uint32_t> free_;
+    uint32_t chunks_count_ = 0;
+    std::atomic<Slot*> chunks_[kMaxChunks] {};
+};
+
+// The pending answer to one MessageCenter::Request. Move-only; destroying
+// it cancels the request if it is still pending, without calling back,
+// and frees its slot.
+template<typename Resp>
+class Reply {
+public:
+    Reply() = default;
+
+    Reply(Reply&& other) noexcept
+        : id_(other.id_)
+    {
+        other.id_ = 0;
+    }
+
+    Reply& operator=(Reply&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            id_ = other.id_;
+            other.id_ = 0;
+        }
+        return *this;
+    }
+
+    ~Reply() {
+        Reset();
+    }
+
+    ReplyStatus Status() const {
+        return id_ ? Table().Status(id_) : ReplyStatus::Cancelled;
+    }
+
+    bool Ready() const {
+        return Status() == ReplyStatus::Ready;
+    }
+
+    // Blocks until the request is answered, times out or is cancelled.
+    ReplyStatus Wait() {
+        return id_ ? Table().Wait(id_) : ReplyStatus::Cancelled;
+    }
+
+    // Only valid while Status() is Ready.
+    Resp& Get() {
+        return Table().Value(id_);
+    }
+
+    void Cancel() {
+        if (id_)
+            Table().Finish(id_, ReplyStatus::Cancelled);
+    }
+
+    // Calls fn(status, value) once, where value is null unless the reply is
+    // Ready. Without a context it runs on the thread that settles the
+    // request; with one it is queued to the context's thread and skipped
+    // if this Reply is gone by then. Replaces an earlier callback.
+    template<typename Function>
+    void Then(Function&& fn, QObject* context = nullptr) {
+        if (!id_) {
+            fn(ReplyStatus::Cancelled, static_cast<Resp*>(nullptr));
+            return;
+        }
+
+        const uint64_t id = id_;
+        auto call = [id, fn = std::forward<Function>(fn)](ReplyStatus status) mutable {
+            Table().Call(id, status, fn);
+        };
+        if (!context) {
+            Table().Then(id, std::move(call));
+            return;
+        }
+
+        Table().Then(id, [context, call = std::move(call)](ReplyStatus status) mutable {
+            QMetaObject::invokeMethod(context, [call = std::move(call), status]() mutable {
+                call(status);
+            }, Qt::QueuedConnection);
+        });
+    }
+
+#ifdef LLMMSG_COROUTINES
+    // co_await resumes on the thread that settles the request, or goes on
+    // without suspending if it settled meanwhile.
+    bool await_ready() const {
+        return Status() != ReplyStatus::Pending;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        if (!id_)
+            return false;
+
+        typename ReplyTable<Resp>::Callback resume = [handle](ReplyStatus) {
+            handle.resume();
+        };
+        return Table().Listen(id_, resume);
+    }
+
+    ReplyStatus await_resume() const {
+        return Status();
+    }
+#endif
+
+private:
+    friend class MessageCenter;
+
+    explicit Reply(uint64_t id)
+        : id_(id)
+    {
+
+    }
+
+    uint64_t Id() const {
+        return id_;
+    }
+
+    static ReplyTable<Resp>& Table() {
+        return ReplyTable<Resp>::Instance();
+    }
+
+    void Reset() {
+        if (id_)
+            Table().Release(id_);
+        id_ = 0;
+    }
+
+private:
+    uint64_t id_ = 0;
+};
+
+// Handed to asynchronous responders; the first Send wins, later ones and
+// sends after a timeout or cancellation return false.
+template<typename Resp>
+class Responder {
+public:
+    explicit Responder(uint64_t id)
+        : id_(id)
+    {
+
+    }
+
+    bool Send(Resp resp) const {
+        return ReplyTable<Resp>::Instance().Complete(id_, std::move(resp));
+    }
+
+    bool Pending() const {
+        return ReplyTable<Resp>::Instance().Status(id_) == ReplyStatus::Pending;
+    }
+
+private:
+    uint64_t id_;
+};
+
+}
+
+#endif // MESSAGEREPLY_H
@@ -0,0 +1,162 @@
+#include <QPointer>
+#include <QQuickWindow>
+
+#include "QmlMessageBridge.h"
+
+namespace lilaomo {
+
+QmlMessageModel::QmlMessageModel(const QStringList& fields, QObject* parent)
+    : QAbstractListModel(parent)
+{
+    for (int i = 0; i < static_cast<int>(fields.size()); ++i)
+        roles_.insert(Qt::UserRole + 1 + i, fields[i].toUtf8());
+}
+
+
+
+int QmlMessageModel::rowCount(const QModelIndex& parent) const {
+    return parent.isValid() ? 0 : static_cast<int>(rows_.size());
+}
+
+
+
+QVariant QmlMessageModel::data(const QModelIndex& index, int role) const {
+    const int column = role - Qt::UserRole - 1;
+    if (!index.isValid() || index.row() >= static_cast<int>(rows_.size()) || column < 0 || column >= roles_.size())
+        return QVariant();
+
+    return rows_[index.row()][column];
+}
+
+
+
+QHash<int, QByteArray> QmlMessageModel::roleNames() const {
+    return roles_;
+}
+
+
+
+int QmlMessageModel::Append(std::vector<QVariant>&& values) {
+    const int row = static_cast<int>(rows_.size());
+    beginInsertRows(QModelIndex(), row, row);
+    rows_.push_back(std::move(values));
+    endInsertRows();
+    return row;
+}
+
+
+
+void QmlMessageModel::SetRow(int row, std::vector<QVariant>&& values) {
+    std::vector<QVariant>& current = rows_[row];
+    QVector<int> changed;
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (current[i] != values[i]) {
+            current[i] = std::move(values[i]);
+            changed.push_back(Qt::UserRole + 1 + static_cast<int>(i));
+        }
+    }
+    if (!changed.isEmpty())
+        emit dataChanged(index(row), index(row), changed);
+}
+
+
+
+class QmlMessageBridge::QmlMessageBridgeImpl {
+public:
+    explicit QmlMessageBridgeImpl(QmlMessageBridge* bridge)
+        : bridge_(bridge)
+    {
+
+    }
+
+    void SetWindow(QQuickWindow* window) {
+        QObject::disconnect(connection_);
+        window_ = window;
+        if (window)
+            connection_ = QObject::connect(window, &QQuickWindow::afterAnimating, bridge_, [this]() {
+                Flush();
+            });
+        if (requested_)
+            Schedule();
+    }
+
+    void Add(std::unique_ptr<Channel>&& channel) {
+        channels_.push_back(std::move(channel));
+    }
+
+    void Flush() {
+        requested_ = false;
+        for (const auto& channel : channels_)
+            channel->Apply();
+    }
+
+    // Many arrivals before the next batch cost a single request.
+    void RequestFrame() {
+        if (requested_)
+            return;
+
+        requested_ = true;
+        Schedule();
+    }
+
+private:
+    void Schedule() {
+        if (window_) {
+            window_->update();
+            return;
+        }
+
+        QMetaObject::invokeMethod(bridge_, [this]() {
+            if (requested_ && !window_)
+                Flush();
+        }, Qt::QueuedConnection);
+    }
+
+private:
+    QmlMessageBridge* bridge_;
+    QPointer<QQuickWindow> window_;
+    QMetaObject::Connection connection_;
+    std::vector<std::unique_ptr<Channel>> channels_;
+    bool requested_ = false;
+};
+
+
+
+QmlMessageBridge::QmlMessageBridge(QObject* parent)
+    : QObject(parent)
+    , impl_(std::make_unique<QmlMessageBridgeImpl>(this))
+{
+
+}
+
+
+
+QmlMessageBridge::~QmlMessageBridge() {
+
+}
+
+
+
+void QmlMessageBridge::SetWindow(QQuickWindow* window) {
+    impl_->SetWindow(window);
+}
+
+
+
+void QmlMessageBridge::Flush() {
+    impl_->Flush();
+}
+
+
+
+void QmlMessageBridge::Add(std::unique_ptr<Channel> channel) {
+    impl_->Add(std::move(channel));
+}
+
+
+
+void QmlMessageBridge::RequestFrame() {
+    impl_->RequestFrame();
+}
+
+}
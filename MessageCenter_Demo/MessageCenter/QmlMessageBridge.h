@@ -0,0 +1,245 @@
+#ifndef QMLMESSAGEBRIDGE_H
+#define QMLMESSAGEBRIDGE_H
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include <QAbstractListModel>
+#include <QQmlPropertyMap>
+#include <QVariant>
+
+#include "MessageCenter.h"
+
+class QQuickWindow;
+
+namespace lilaomo {
+
+// One value QML sees of a message: a data member, a const member
+// function or any other getter.
+template<typename MsgType>
+struct QmlField {
+    template<typename T, typename Class, typename = std::enable_if_t<std::is_member_object_pointer<T Class::*>::value>>
+    QmlField(const char* name, T Class::* member)
+        : name(QString::fromLatin1(name))
+        , get([member](const MsgType& msg) { return QVariant::fromValue(msg.*member); })
+    {
+
+    }
+
+    template<typename T, typename Class>
+    QmlField(const char* name, T (Class::* getter)() const)
+        : name(QString::fromLatin1(name))
+        , get([getter](const MsgType& msg) { return QVariant::fromValue((msg.*getter)()); })
+    {
+
+    }
+
+    template<typename Getter, typename = std::enable_if_t<!std::is_member_pointer<std::decay_t<Getter>>::value>>
+    QmlField(const char* name, Getter&& getter)
+        : name(QString::fromLatin1(name))
+        , get([getter = std::forward<Getter>(getter)](const MsgType& msg) { return QVariant::fromValue(getter(msg)); })
+    {
+
+    }
+
+    QString name;
+    std::function<QVariant(const MsgType&)> get;
+};
+
+// List model behind QmlMessageBridge::Model: one row per key, one role per
+// field, named after it.
+class QmlMessageModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+public:
+    explicit QmlMessageModel(const QStringList& fields, QObject* parent = nullptr);
+
+    int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex& index, int role) const override;
+    QHash<int, QByteArray> roleNames() const override;
+
+    int Append(std::vector<QVariant>&& values);
+    // Notifies only the roles whose value changed.
+    void SetRow(int row, std::vector<QVariant>&& values);
+
+private:
+    QHash<int, QByteArray> roles_;
+    std::vector<std::vector<QVariant>> rows_;
+};
+
+// Shows message types to QML without a signal per publish. Messages are
+// queued to the bridge's thread, where only the newest one per type (or
+// per key of a model) is kept; once per frame, right after the window's
+// animations have advanced and before the scene graph syncs, the bridge
+// turns them into QML values and notifies the fields that changed.
+//
+// Create it on the GUI thread; the objects it returns belong to it.
+class QmlMessageBridge : public QObject
+{
+    Q_OBJECT
+    class QmlMessageBridgeImpl;
+    using ImplType = std::unique_ptr<QmlMessageBridgeImpl>;
+
+public:
+    explicit QmlMessageBridge(QObject* parent = nullptr);
+    ~QmlMessageBridge();
+
+    // Updates are applied from the window's afterAnimating, and a frame is
+    // requested when some arrive. Without a window they're applied from
+    // the event loop, still one batch per turn.
+    void SetWindow(QQuickWindow* window);
+
+    // A property per field, following the newest MsgType; undefined before
+    // the first one arrives. Set it as a context property, say.
+    template<typename MsgType>
+    BASE_OF_T(MsgType, QQmlPropertyMap*) Properties(std::vector<QmlField<MsgType>> fields) {
+        auto channel = std::make_unique<PropertyChannel<MsgType>>(this, std::move(fields));
+        QQmlPropertyMap* map = channel->map;
+        Add(std::move(channel));
+        return map;
+    }
+
+    // A row per distinct key(msg), in order of first arrival, following the
+    // newest MsgType with that key.
+    template<typename MsgType, typename KeyFunction>
+    BASE_OF_T(MsgType, QmlMessageModel*) Model(KeyFunction&& key, std::vector<QmlField<MsgType>> fields) {
+        using Key = std::decay_t<decltype(key(std::declval<const MsgType&>()))>;
+        auto channel = std::make_unique<ModelChannel<MsgType, Key>>(this, std::forward<KeyFunction>(key), std::move(fields));
+        QmlMessageModel* model = channel->model;
+        Add(std::move(channel));
+        return model;
+    }
+
+    // Applies whatever arrived since the last batch, now.
+    void Flush();
+
+private:
+    class Channel {
+    public:
+        virtual ~Channel() {
+            subscription.Cancel();
+        }
+
+        virtual void Apply() = 0;
+
+        Subscription subscription;
+    };
+
+    static SubscribeOptions Options(QmlMessageBridge* bridge, bool conflate) {
+        SubscribeOptions options(Delivery::Queued);
+        options.context = bridge;
+        options.conflate = conflate;
+        return options;
+    }
+
+    template<typename MsgType>
+    static std::vector<QVariant> Values(const std::vector<QmlField<MsgType>>& fields, const MsgType& msg) {
+        std::vector<QVariant> values;
+        values.reserve(fields.size());
+        for (const QmlField<MsgType>& field : fields)
+            values.push_back(field.get(msg));
+        return values;
+    }
+
+    // Conflated, so at most one delivery per frame reaches the handler.
+    template<typename MsgType>
+    class PropertyChannel : public Channel {
+    public:
+        PropertyChannel(QmlMessageBridge* bridge, std::vector<QmlField<MsgType>>&& fields)
+            : map(new QQmlPropertyMap(bridge))
+            , fields_(std::move(fields))
+        {
+            for (const QmlField<MsgType>& field : fields_)
+                map->insert(field.name, QVariant());
+            subscription = LLMMSG->Subscribe<MsgType>([this, bridge](const MsgType& msg) {
+                latest_ = msg;
+                bridge->RequestFrame();
+            }, Options(bridge, true));
+        }
+
+        void Apply() override {
+            if (!latest_)
+                return;
+
+            for (const QmlField<MsgType>& field : fields_) {
+                QVariant value = field.get(*latest_);
+                if (map->value(field.name) != value)
+                    map->insert(field.name, value);
+            }
+            latest_.reset();
+        }
+
+        QQmlPropertyMap* map;
+
+    private:
+        std::vector<QmlField<MsgType>> fields_;
+        std::optional<MsgType> latest_;
+    };
+
+    // Not conflated, since messages with other keys mustn't replace each
+    // other; the handler only overwrites the key's pending message.
+    template<typename MsgType, typename Key>
+    class ModelChannel : public Channel {
+    public:
+        template<typename KeyFunction>
+        ModelChannel(QmlMessageBridge* bridge, KeyFunction&& key, std::vector<QmlField<MsgType>>&& fields)
+            : model(new QmlMessageModel(Names(fields), bridge))
+            , key_(std::forward<KeyFunction>(key))
+            , fields_(std::move(fields))
+        {
+            subscription = LLMMSG->Subscribe<MsgType>([this, bridge](const MsgType& msg) {
+                Key key = key_(msg);
+                auto iter = pending_index_.find(key);
+                if (iter != pending_index_.end()) {
+                    pending_[iter->second].second = msg;
+                    return;
+                }
+                pending_index_.emplace(key, pending_.size());
+                pending_.emplace_back(std::move(key), msg);
+                bridge->RequestFrame();
+            }, Options(bridge, false));
+        }
+
+        void Apply() override {
+            for (auto& pending : pending_) {
+                auto row = rows_.find(pending.first);
+                if (row == rows_.end())
+                    rows_.emplace(pending.first, model->Append(Values(fields_, pending.second)));
+                else
+                    model->SetRow(row->second, Values(fields_, pending.second));
+            }
+            pending_.clear();
+            pending_index_.clear();
+        }
+
+        QmlMessageModel* model;
+
+    private:
+        static QStringList Names(const std::vector<QmlField<MsgType>>& fields) {
+            QStringList names;
+            for (const QmlField<MsgType>& field : fields)
+                names << field.name;
+            return names;
+        }
+
+    private:
+        std::function<Key(const MsgType&)> key_;
+        std::vector<QmlField<MsgType>> fields_;
+        std::vector<std::pair<Key, MsgType>> pending_;
+        std::unordered_map<Key, size_t> pending_index_;
+        std::unordered_map<Key, int> rows_;
+    };
+
+    void Add(std::unique_ptr<Channel> channel);
+    void RequestFrame();
+
+private:
+    ImplType impl_;
+};
+
+}
+
+#endif // QMLMESSAGEBRIDGE_H
@@ -0,0 +1,498 @@
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QSharedMemory>
+#ifdef Q_OS_LINUX
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "MessageCodec.h"
+#include "SharedMemoryBridge.h"
+
+namespace lilaomo {
+
+namespace {
+
+constexpr uint32_t kRingMagic = 0x4c4c4d52;
+constexpr uint32_t kRingVersion = 1;
+constexpr uint64_t kPadding = 1ull << 63;
+constexpr size_t kFrameAlign = 16;
+
+// Every process maps the ring at its own address, so only atomics that
+// work on plain memory may live in it.
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "the shared ring needs lock-free atomics");
+
+struct RingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;                          // bytes of frames after the header
+    alignas(64) std::atomic<uint64_t> reserve;  // logical end of the last claimed frame
+    alignas(64) std::atomic<uint32_t> signal;   // futex word, bumped on every commit
+    std::atomic<uint32_t> waiters;
+};
+
+// A frame starts at logical position pos, at pos % capacity in the ring.
+// Data frames carry a FramePrefix and the encoded message; padding frames
+// fill a claim that would have wrapped around the end.
+struct FrameHeader {
+    std::atomic<uint64_t> tag;  // pos + 1 once committed, with kPadding on filler
+    uint32_t length;            // whole frame, multiple of kFrameAlign
+    uint32_t origin;            // pid of the writer
+};
+
+struct FramePrefix {
+    uint64_t codec;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(FrameHeader) == kFrameAlign && sizeof(FramePrefix) == kFrameAlign,
+              "frames are laid out in kFrameAlign units");
+
+size_t AlignFrame(size_t size) {
+    return (size + kFrameAlign - 1) & ~(kFrameAlign - 1);
+}
+
+// The message the reader thread is re-publishing right now, so the
+// bridge's own subscription doesn't send it straight back.
+thread_local const void* t_relayed = nullptr;
+
+void FutexWait(std::atomic<uint32_t>& word, uint32_t value, std::chrono::nanoseconds timeout) {
+#ifdef Q_OS_LINUX
+    timespec ts;
+    ts.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+    ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, value, &ts, nullptr, 0);
+#else
+    (void)word;
+    (void)value;
+    (void)timeout;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+}
+
+void FutexWake(std::atomic<uint32_t>& word) {
+#ifdef Q_OS_LINUX
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+    (void)word;
+#endif
+}
+
+}
+
+
+
+// This process's mapping of the ring. Bridged subscriptions hold it too,
+// so it stays mapped until the last publish in flight has written.
+class SharedRing {
+public:
+    enum class Read {
+        Empty,      // nothing committed at the cursor yet
+        Data,       // a frame from another process
+        Skipped,    // padding or one of our own frames
+        Lost        // overwritten under the cursor; it jumped to the end
+    };
+
+    explicit SharedRing(const QString& key)
+        : shm_(key)
+        , origin_(static_cast<uint32_t>(QCoreApplication::applicationPid()))
+    {
+
+    }
+
+    bool Open(size_t capacity) {
+        const size_t size = sizeof(RingHeader) + AlignFrame(capacity);
+        const bool created = shm_.create(static_cast<int>(size));
+        if (!created && (shm_.error() != QSharedMemory::AlreadyExists || !shm_.attach())) {
+            qWarning() << "SharedMemoryBridge:" << shm_.errorString();
+            return false;
+        }
+
+        shm_.lock();
+        auto header = static_cast<RingHeader*>(shm_.data());
+        const size_t mapped = static_cast<size_t>(shm_.size());
+        // Fresh segments are zero-filled, so whoever takes the lock first
+        // initializes; the creator may get it only after an attacher has
+        // set the ring up and started writing. A creator that died before
+        // initializing leaves no magic behind either. The magic goes last.
+        if (header->magic != kRingMagic) {
+            new (header) RingHeader();
+            header->version = kRingVersion;
+            header->capacity = (mapped - sizeof(RingHeader)) & ~(kFrameAlign - 1);
+            std::memset(reinterpret_cast<char*>(header + 1), 0, header->capacity);
+            header->magic = kRingMagic;
+        }
+        const bool valid = header->version == kRingVersion && sizeof(RingHeader) + header->capacity <= mapped;
+        shm_.unlock();
+
+        if (!valid) {
+            qWarning() << "SharedMemoryBridge: incompatible ring" << shm_.key();
+            shm_.detach();
+            return false;
+        }
+
+        header_ = header;
+        data_ = reinterpret_cast<char*>(header + 1);
+        capacity_ = header->capacity;
+        return true;
+    }
+
+    // Claims space with a single fetch_add and never waits for readers. A
+    // claim that would wrap around the end is turned into padding and
+    // claimed again.
+    bool Write(uint64_t codec, const QByteArray& payload) {
+        const size_t length = AlignFrame(sizeof(FrameHeader) + sizeof(FramePrefix) + payload.size());
+        if (length > capacity_ / 4)
+            return false;
+
+        for (;;) {
+            const uint64_t pos = header_->reserve.fetch_add(length, std::memory_order_acq_rel);
+            const size_t offset = pos % capacity_;
+            const size_t room = capacity_ - offset;
+            if (room < length) {
+                Pad(pos, room);
+                Pad(pos + room, length - room);
+                continue;
+            }
+
+            FrameHeader* frame = Frame(offset);
+            frame->length = static_cast<uint32_t>(length);
+            frame->origin = origin_;
+            const FramePrefix prefix { codec, static_cast<uint32_t>(payload.size()), 0 };
+            char* body = reinterpret_cast<char*>(frame + 1);
+            std::memcpy(body, &prefix, sizeof(prefix));
+            std::memcpy(body + sizeof(prefix), payload.constData(), payload.size());
+            frame->tag.store(pos + 1, std::memory_order_release);
+            break;
+        }
+
+        header_->signal.fetch_add(1, std::memory_order_seq_cst);
+        if (header_->waiters.load(std::memory_order_seq_cst) > 0)
+            FutexWake(header_->signal);
+        return true;
+    }
+
+    // Copies the frame at cursor out before checking that no writer has
+    // lapped it meanwhile, like a seqlock read.
+    Read Next(uint64_t& cursor, uint64_t& codec, QByteArray& payload) {
+        const uint64_t reserve = header_->reserve.load(std::memory_order_acquire);
+        if (reserve == cursor)
+            return Read::Empty;
+        if (reserve - cursor > capacity_) {
+            cursor = reserve;
+            return Read::Lost;
+        }
+
+        const size_t offset = cursor % capacity_;
+        FrameHeader* frame = Frame(offset);
+        const uint64_t tag = frame->tag.load(std::memory_order_acquire);
+        if ((tag & ~kPadding) != cursor + 1)
+            return Read::Empty;
+
+        const size_t length = frame->length;
+        bool data = false;
+        if (!(tag & kPadding) && frame->origin != origin_ && length >= sizeof(FrameHeader) + sizeof(FramePrefix)
+                && length <= capacity_ - offset) {
+            FramePrefix prefix;
+            const char* body = reinterpret_cast<const char*>(frame + 1);
+            std::memcpy(&prefix, body, sizeof(prefix));
+            if (prefix.size <= length - sizeof(FrameHeader) - sizeof(FramePrefix)) {
+                codec = prefix.codec;
+                payload.resize(prefix.size);
+                std::memcpy(payload.data(), body + sizeof(prefix), prefix.size);
+                data = true;
+            }
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint64_t after = header_->reserve.load(std::memory_order_relaxed);
+        if (after - cursor > capacity_ || length == 0 || length % kFrameAlign != 0) {
+            cursor = after;
+            return Read::Lost;
+        }
+
+        cursor += length;
+        return data ? Read::Data : Read::Skipped;
+    }
+
+    uint64_t End() const {
+        return header_->reserve.load(std::memory_order_acquire);
+    }
+
+    // Sleeps until a writer commits or timeout passes, unless the frame at
+    // cursor is already there.
+    void Wait(uint64_t cursor, std::chrono::nanoseconds timeout) {
+        header_->waiters.fetch_add(1, std::memory_order_seq_cst);
+        const uint32_t signal = header_->signal.load(std::memory_order_seq_cst);
+        if (!Ready(cursor))
+            FutexWait(header_->signal, signal, timeout);
+        header_->waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void Wake() {
+        header_->signal.fetch_add(1, std::memory_order_seq_cst);
+        FutexWake(header_->signal);
+    }
+
+public:
+    std::atomic<uint64_t> sent { 0 };
+    std::atomic<uint64_t> received { 0 };
+    std::atomic<uint64_t> dropped { 0 };
+    std::atomic<uint64_t> lost { 0 };
+
+private:
+    FrameHeader* Frame(size_t offset) const {
+        return reinterpret_cast<FrameHeader*>(data_ + offset);
+    }
+
+    void Pad(uint64_t pos, size_t length) {
+        FrameHeader* frame = Frame(pos % capacity_);
+        frame->length = static_cast<uint32_t>(length);
+        frame->origin = origin_;
+        frame->tag.store((pos + 1) | kPadding, std::memory_order_release);
+    }
+
+    bool Ready(uint64_t cursor) const {
+        const uint64_t reserve = header_->reserve.load(std::memory_order_seq_cst);
+        if (reserve == cursor)
+            return false;
+        if (reserve - cursor > capacity_)
+            return true;
+        return (Frame(cursor % capacity_)->tag.load(std::memory_order_seq_cst) & ~kPadding) == cursor + 1;
+    }
+
+private:
+    QSharedMemory shm_;
+    const uint32_t origin_;
+    RingHeader* header_ = nullptr;
+    char* data_ = nullptr;
+    size_t capacity_ = 0;
+};
+
+
+
+class SharedMemoryBridge::SharedMemoryBridgeImpl {
+public:
+    using CodecMap = std::unordered_map<uint64_t, std::shared_ptr<const MessageCodec>>;
+    using CodecMapPtr = std::shared_ptr<const CodecMap>;
+
+    SharedMemoryBridgeImpl(const QString& key, size_t capacity)
+        : key_(key)
+        , capacity_(capacity)
+        , codecs_(std::make_shared<const CodecMap>())
+    {
+
+    }
+
+    ~SharedMemoryBridgeImpl() {
+        Close();
+    }
+
+    bool Open() {
+        if (ring_)
+            return true;
+
+        auto ring = std::make_shared<SharedRing>(key_);
+        if (!ring->Open(capacity_))
+            return false;
+
+        ring_ = std::move(ring);
+        stop_.store(false, std::memory_order_relaxed);
+        reader_ = std::thread([this, ring = ring_]() {
+            Read(*ring);
+        });
+        return true;
+    }
+
+    void Close() {
+        if (!ring_)
+            return;
+
+        stop_.store(true, std::memory_order_release);
+        ring_->Wake();
+        reader_.join();
+
+        for (Subscription& subscription : subscriptions_)
+            subscription.Cancel();
+        subscriptions_.clear();
+        std::atomic_store_explicit(&codecs_, std::make_shared<const CodecMap>(), std::memory_order_release);
+        ring_.reset();
+    }
+
+    std::function<void(const void*)> Sender(size_t type) {
+        if (!ring_) {
+            qWarning() << "SharedMemoryBridge: bridge" << MessageTypeName(type) << "after Open";
+            return nullptr;
+        }
+
+        std::shared_ptr<const MessageCodec> codec = LLMCODEC->FindType(type);
+        if (!codec) {
+            qWarning() << "SharedMemoryBridge: no codec registered for" << MessageTypeName(type);
+            return nullptr;
+        }
+
+        CodecMapPtr codecs = std::atomic_load_explicit(&codecs_, std::memory_order_acquire);
+        auto next = std::make_shared<CodecMap>(*codecs);
+        (*next)[codec->id] = codec;
+        std::atomic_store_explicit(&codecs_, CodecMapPtr(std::move(next)), std::memory_order_release);
+
+        return [ring = ring_, codec](const void* msg) {
+            if (msg == t_relayed)
+                return;
+
+            thread_local QByteArray buffer;
+            codec->encode(msg, buffer);
+            if (ring->Write(codec->id, buffer))
+                ring->sent.fetch_add(1, std::memory_order_relaxed);
+            else
+                ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        };
+    }
+
+    void Track(Subscription&& subscription) {
+        subscriptions_.push_back(std::move(subscription));
+    }
+
+    BridgeStats Stats() const {
+        if (!ring_)
+            return {};
+
+        return BridgeStats {
+            ring_->sent.load(std::memory_order_relaxed),
+            ring_->received.load(std::memory_order_relaxed),
+            ring_->dropped.load(std::memory_order_relaxed),
+            ring_->lost.load(std::memory_order_relaxed)
+        };
+    }
+
+private:
+    // Starts at the current end: a process only sees what is published
+    // after it opened the bridge.
+    void Read(SharedRing& ring) {
+        uint64_t cursor = ring.End();
+        uint64_t codec = 0;
+        QByteArray payload;
+        std::chrono::steady_clock::time_point stalled {};
+        while (!stop_.load(std::memory_order_acquire)) {
+            switch (ring.Next(cursor, codec, payload)) {
+            case SharedRing::Read::Data:
+                Relay(ring, codec, payload);
+                stalled = {};
+                break;
+            case SharedRing::Read::Skipped:
+                stalled = {};
+                break;
+            case SharedRing::Read::Lost:
+                ring.lost.fetch_add(1, std::memory_order_relaxed);
+                stalled = {};
+                break;
+            case SharedRing::Read::Empty:
+                // A writer that died between claiming and committing would
+                // block the cursor for good; give up on it after a while.
+                if (ring.End() != cursor) {
+                    const auto now = std::chrono::steady_clock::now();
+                    if (stalled == std::chrono::steady_clock::time_point {}) {
+                        stalled = now;
+                    } else if (now - stalled > kStallTimeout) {
+                        cursor = ring.End();
+                        ring.lost.fetch_add(1, std::memory_order_relaxed);
+                        stalled = {};
+                        break;
+                    }
+                }
+                ring.Wait(cursor, kWaitTimeout);
+                break;
+            }
+        }
+    }
+
+    // Frames of types this process doesn't bridge are ignored.
+    void Relay(SharedRing& ring, uint64_t id, const QByteArray& payload) {
+        CodecMapPtr codecs = std::atomic_load_explicit(&codecs_, std::memory_order_acquire);
+        auto iter = codecs->find(id);
+        if (iter == codecs->end())
+            return;
+
+        const MessageCodec& codec = *iter->second;
+        const bool decoded = codec.decode(payload.constData(), static_cast<size_t>(payload.size()), [&codec](void* msg) {
+            t_relayed = msg;
+            codec.publish(msg);
+            t_relayed = nullptr;
+        });
+        if (decoded)
+            ring.received.fetch_add(1, std::memory_order_relaxed);
+        else
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr std::chrono::milliseconds kWaitTimeout { 50 };
+    static constexpr std::chrono::milliseconds kStallTimeout { 200 };
+
+    QString key_;
+    size_t capacity_;
+    std::shared_ptr<SharedRing> ring_;
+    std::atomic<bool> stop_ { false };
+    std::thread reader_;
+    CodecMapPtr codecs_;
+    std::vector<Subscription> subscriptions_;
+};
+
+
+
+SharedMemoryBridge::SharedMemoryBridge(const QString& key, size_t capacity, QObject* parent)
+    : QObject(parent)
+    , impl_(std::make_unique<SharedMemoryBridgeImpl>(key, capacity))
+{
+
+}
+
+
+
+SharedMemoryBridge::~SharedMemoryBridge() {
+
+}
+
+
+
+bool SharedMemoryBridge::Open() {
+    return impl_->Open();
+}
+
+
+
+void SharedMemoryBridge::Close() {
+    impl_->Close();
+}
+
+
+
+BridgeStats SharedMemoryBridge::Stats() const {
+    return impl_->Stats();
+}
+
+
+
+std::function<void(const void*)> SharedMemoryBridge::Sender(size_t type) {
+    return impl_->Sender(type);
+}
+
+
+
+void SharedMemoryBridge::Track(Subscription subscription) {
+    impl_->Track(std::move(subscription));
+}
+
+}
@@ -0,0 +1,70 @@
+#ifndef SHAREDMEMORYBRIDGE_H
+#define SHAREDMEMORYBRIDGE_H
+
+#include <functional>
+#include <memory>
+#include <QObject>
+
+#include "MessageCenter.h"
+
+namespace lilaomo {
+
+struct BridgeStats {
+    uint64_t sent = 0;
+    uint64_t received = 0;      // remote messages published locally
+    uint64_t dropped = 0;       // too large for the ring, or undecodable
+    uint64_t lost = 0;          // overwritten before this process read them
+};
+
+// Joins the MessageCenter of every process on the machine that opens the
+// same key. Bridged message types published in one process are published
+// in all the others as well, as if they were local.
+//
+// The processes share one broadcast ring in shared memory: publishers
+// append frames without taking a lock, and each process has a reader
+// thread that wakes up on a futex on Linux (polls every millisecond
+// elsewhere), decodes frames and re-publishes them locally. A reader that
+// falls a whole ring behind loses the overwritten frames.
+class SharedMemoryBridge : public QObject
+{
+    Q_OBJECT
+    class SharedMemoryBridgeImpl;
+    using ImplType = std::unique_ptr<SharedMemoryBridgeImpl>;
+
+public:
+    explicit SharedMemoryBridge(const QString& key, size_t capacity = 4 << 20, QObject* parent = nullptr);
+    ~SharedMemoryBridge();
+
+    // Creates the ring or attaches to an existing one and starts reading.
+    // An existing ring keeps its own capacity.
+    bool Open();
+    void Close();
+
+    // Sends local MsgType publishes to the other processes and publishes
+    // theirs here. MsgType needs a codec (see CodecRegistry) under the same
+    // name in every process, and the bridge must be open.
+    template<typename MsgType>
+    BASE_OF_T(MsgType, bool) Bridge() {
+        auto send = Sender(MessageTypeId<MsgType>());
+        if (!send)
+            return false;
+
+        Track(LLMMSG->Subscribe<MsgType>([send = std::move(send)](const MsgType& msg) {
+            send(&msg);
+        }));
+        return true;
+    }
+
+    BridgeStats Stats() const;
+
+private:
+    std::function<void(const void* msg)> Sender(size_t type);
+    void Track(Subscription subscription);
+
+private:
+    ImplType impl_;
+};
+
+}
+
+#endif // SHAREDMEMORYBRIDGE_H
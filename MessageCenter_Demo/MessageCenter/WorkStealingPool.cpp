@@ -0,0 +1,115 @@
+#include <algorithm>
+
+#include "WorkStealingPool.h"
+
+namespace lilaomo {
+
+namespace {
+
+// Worker slot of the current thread in its pool, or npos outside of one.
+thread_local const WorkStealingPool* t_pool = nullptr;
+thread_local size_t t_index = static_cast<size_t>(-1);
+
+}
+
+
+
+WorkStealingPool::WorkStealingPool(size_t threads) {
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; ++i)
+        workers_.emplace_back(std::make_unique<Worker>());
+    for (size_t i = 0; i < threads; ++i)
+        threads_.emplace_back(&WorkStealingPool::Run, this, i);
+}
+
+
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::unique_lock<std::mutex> ulock(mtx_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread : threads_)
+        thread.join();
+}
+
+
+
+void WorkStealingPool::Submit(Task&& task) {
+    const size_t index = t_pool == this
+            ? t_index
+            : next_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+    {
+        std::unique_lock<std::mutex> ulock(workers_[index]->mtx);
+        workers_[index]->tasks.emplace_back(std::move(task));
+    }
+    pending_.fetch_add(1, std::memory_order_release);
+
+    std::unique_lock<std::mutex> ulock(mtx_);
+    cv_.notify_one();
+}
+
+
+
+void WorkStealingPool::Wait(Latch& latch) {
+    const size_t self = t_pool == this ? t_index : 0;
+    while (!latch.Done()) {
+        if (!TryRun(self))
+            latch.WaitFor(std::chrono::milliseconds(1));
+    }
+    latch.Release();
+}
+
+
+
+void WorkStealingPool::Run(size_t index) {
+    t_pool = this;
+    t_index = index;
+    for (;;) {
+        if (TryRun(index))
+            continue;
+
+        std::unique_lock<std::mutex> ulock(mtx_);
+        cv_.wait(ulock, [this]() {
+            return stop_ || pending_.load(std::memory_order_acquire) > 0;
+        });
+        if (stop_)
+            return;
+    }
+}
+
+
+
+bool WorkStealingPool::TryRun(size_t self) {
+    Task task;
+    bool found = Pop(self, true, task);
+    for (size_t i = 1; !found && i < workers_.size(); ++i)
+        found = Pop((self + i) % workers_.size(), false, task);
+    if (!found)
+        return false;
+
+    pending_.fetch_sub(1, std::memory_order_relaxed);
+    task();
+    return true;
+}
+
+
+
+bool WorkStealingPool::Pop(size_t index, bool back, Task& task) {
+    Worker& worker = *workers_[index];
+    std::unique_lock<std::mutex> ulock(worker.mtx);
+    if (worker.tasks.empty())
+        return false;
+
+    if (back) {
+        task = std::move(worker.tasks.back());
+        worker.tasks.pop_back();
+    } else {
+        task = std::move(worker.tasks.front());
+        worker.tasks.pop_front();
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,99 @@
+#ifndef WORKSTEALINGPOOL_H
+#define WORKSTEALINGPOOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lilaomo {
+
+// Counts outstanding tasks of one fan-out.
+class Latch {
+public:
+    explicit Latch(size_t count = 0)
+        : count_(count)
+    {
+
+    }
+
+    void Add(size_t count = 1) {
+        count_.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    // Decrements and notifies under the lock, so that once Release has
+    // returned no counting thread touches the latch any more.
+    void CountDown() {
+        std::unique_lock<std::mutex> ulock(mtx_);
+        if (count_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            cv_.notify_all();
+    }
+
+    bool Done() const {
+        return count_.load(std::memory_order_acquire) == 0;
+    }
+
+    template<typename Rep, typename Period>
+    void WaitFor(const std::chrono::duration<Rep, Period>& timeout) {
+        std::unique_lock<std::mutex> ulock(mtx_);
+        cv_.wait_for(ulock, timeout, [this]() { return Done(); });
+    }
+
+    // Waits out the thread that counted down to zero; after Done() the
+    // latch may only be destroyed once this has returned.
+    void Release() {
+        std::unique_lock<std::mutex> ulock(mtx_);
+    }
+
+private:
+    std::atomic<size_t> count_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+};
+
+// Bounded pool where every worker owns a deque: it takes its own work from
+// the back and steals from the front of the others when it runs dry.
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkStealingPool(size_t threads);
+    ~WorkStealingPool();
+
+    // Tasks submitted from a worker stay on that worker's deque.
+    void Submit(Task&& task);
+
+    // Runs pool tasks on the calling thread while waiting, so a handler
+    // that publishes and joins from a worker can't starve the pool. The
+    // latch may be destroyed as soon as this returns.
+    void Wait(Latch& latch);
+
+private:
+    struct Worker {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+    };
+
+    void Run(size_t index);
+    bool TryRun(size_t self);
+    bool Pop(size_t index, bool back, Task& task);
+
+private:
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> next_ { 0 };
+    std::atomic<size_t> pending_ { 0 };
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+};
+
+}
+
+#endif // WORKSTEALINGPOOL_H
@@ -0,0 +1,10 @@
+QT -= gui
+CONFIG += console c++17
+CONFIG -= app_bundle
+
+INCLUDEPATH += $$PWD/..
+
+SOURCES += \
+        main.cpp
+
+include(../MessageCenter/MessageCenter.pri)
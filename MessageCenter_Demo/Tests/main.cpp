@@ -0,0 +1,212 @@
+// MessageCenter behavior checks. Runs every check, prints one line per
+// failed expectation and exits nonzero if there was any.
+//
+//   Tests
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <QCoreApplication>
+#include <QObject>
+#include <QTemporaryDir>
+
+#include "MessageCenter/EpochDomain.h"
+#include "MessageCenter/MessageCenter.h"
+#include "MessageCenter/MessageCodec.h"
+#include "MessageCenter/MessageJournal.h"
+#include "MessageCenter/MessageReply.h"
+
+using namespace lilaomo;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+int g_failures = 0;
+
+#define CHECK(expr)                                                             \
+    do {                                                                        \
+        if (!(expr)) {                                                          \
+            std::fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #expr);     \
+            ++g_failures;                                                       \
+        }                                                                       \
+    } while (false)
+
+int64_t ElapsedMs(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+}
+
+
+
+// A retired object outlives every guard of a reader that may hold it,
+// including the outer one of a nested pair: closing the inner guard must
+// not withdraw the reader, nor opening it announce a newer epoch.
+void EpochNestedGuards() {
+    static std::atomic<int> destroyed { 0 };
+    struct Counted {
+        ~Counted() { destroyed.fetch_add(1); }
+    };
+
+    EpochPointer<Counted> pointer(new Counted());
+    {
+        EpochGuard outer;
+        Counted* seen = pointer.Load();
+        pointer.Store(new Counted());
+        {
+            EpochGuard inner;
+            CHECK(pointer.Load() != seen);
+        }
+        EpochDomain::Instance().Collect();
+        CHECK(destroyed.load() == 0);
+
+        // A reader on another thread doesn't pin what it can't have seen.
+        std::thread([] { EpochGuard guard; }).join();
+        EpochDomain::Instance().Collect();
+        CHECK(destroyed.load() == 0);
+    }
+    EpochDomain::Instance().Collect();
+    CHECK(destroyed.load() == 1);
+}
+
+
+
+// A released slot is handed out again under a new generation; whatever
+// still holds the old id can neither settle nor observe the new request.
+void ReplySlotReuse() {
+    ReplyTable<int>& table = ReplyTable<int>::Instance();
+    const uint64_t first = table.Acquire();
+    CHECK(table.Complete(first, 1));
+    CHECK(!table.Complete(first, 2));
+    table.Release(first);
+
+    const uint64_t second = table.Acquire();
+    CHECK(static_cast<uint32_t>(second) == static_cast<uint32_t>(first));
+    CHECK(second != first);
+    CHECK(table.Status(second) == ReplyStatus::Pending);
+
+    CHECK(!table.Complete(first, 3));
+    CHECK(!table.Finish(first, ReplyStatus::Cancelled));
+    CHECK(table.Status(second) == ReplyStatus::Pending);
+
+    CHECK(table.Complete(second, 4));
+    int calls = 0;
+    auto fn = [&calls](ReplyStatus, int*) { ++calls; };
+    table.Call(first, ReplyStatus::Ready, fn);
+    CHECK(calls == 0);
+    table.Call(second, ReplyStatus::Ready, fn);
+    CHECK(calls == 1);
+    CHECK(table.Value(second) == 4);
+    table.Release(second);
+}
+
+
+
+struct Reading : Message {
+    int value = 0;
+};
+
+// A queued call still waiting when its message's deadline passes is
+// dropped and counted as expired; calls without a deadline are delivered.
+void QueuedDeadlineDrops() {
+    QObject context;
+    SubscribeOptions options(Delivery::Queued);
+    options.context = &context;
+    int received = 0;
+    auto subscription = LLMMSG->Subscribe<Reading>([&received](const Reading& reading) {
+        received += reading.value;
+    }, options);
+
+    uint64_t expired = 0;
+    for (const ReceiverStats& stats : LLMMSG->QueueStats())
+        expired += stats.lanes[static_cast<size_t>(Priority::Normal)].expired;
+
+    Reading late;
+    late.value = 1;
+    late.SetDeadline(Clock::now() + std::chrono::milliseconds(5));
+    LLMMSG->Publish(late);
+    Reading timely;
+    timely.value = 10;
+    LLMMSG->Publish(timely);
+    CHECK(received == 0);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    QCoreApplication::processEvents();
+    CHECK(received == 10);
+
+    uint64_t after = 0;
+    for (const ReceiverStats& stats : LLMMSG->QueueStats())
+        after += stats.lanes[static_cast<size_t>(Priority::Normal)].expired;
+    CHECK(after == expired + 1);
+    subscription.Cancel();
+}
+
+
+
+struct Sample : Message {
+    int n = 0;
+};
+
+// Each recording session keeps its own pacing; the time between two
+// sessions is not played back.
+void ReplaySessionPacing() {
+    constexpr int kPerSession = 5;
+    constexpr auto kSpacing = std::chrono::milliseconds(40);
+    constexpr auto kGap = std::chrono::milliseconds(1000);
+
+    QTemporaryDir directory;
+    CHECK(directory.isValid());
+    LLMCODEC->Register<Sample>("Sample");
+    for (int session = 0; session < 2; ++session) {
+        if (session)
+            std::this_thread::sleep_for(kGap);
+        JournalRecorder recorder(directory.path());
+        CHECK(recorder.Open());
+        CHECK(recorder.Record<Sample>());
+        for (int i = 0; i < kPerSession; ++i) {
+            if (i)
+                std::this_thread::sleep_for(kSpacing);
+            Sample sample;
+            sample.n = session * kPerSession + i;
+            LLMMSG->Publish(sample);
+        }
+        recorder.Close();
+    }
+
+    std::atomic<int> next { 0 };
+    std::atomic<bool> ordered { true };
+    auto subscription = LLMMSG->Subscribe<Sample>([&next, &ordered](const Sample& sample) {
+        if (sample.n != next.fetch_add(1))
+            ordered = false;
+    });
+    JournalReplay replay(directory.path());
+    const Clock::time_point start = Clock::now();
+    CHECK(replay.Start(1.0));
+    replay.Wait();
+    const int64_t elapsed = ElapsedMs(start);
+    subscription.Cancel();
+
+    const int64_t paced = 2 * (kPerSession - 1) * kSpacing.count();
+    CHECK(replay.Stats().published == 2 * kPerSession);
+    CHECK(next.load() == 2 * kPerSession);
+    CHECK(ordered.load());
+    CHECK(elapsed >= paced * 3 / 4);
+    CHECK(elapsed < paced + kGap.count() / 2);
+}
+
+}
+
+
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    EpochNestedGuards();
+    ReplySlotReuse();
+    QueuedDeadlineDrops();
+    ReplaySessionPacing();
+
+    if (g_failures)
+        std::fprintf(stderr, "%d check(s) failed\n", g_failures);
+    return g_failures ? 1 : 0;
+}
@@ -1,8 +1,11 @@
 #include <QGuiApplication>
 #include <QQmlApplicationEngine>
+#include <QQmlContext>
+#include <QQuickWindow>
 #include <qmetaobject.h>
 
 #include "MessageCenter/MessageCenter.h"
+#include "MessageCenter/QmlMessageBridge.h"
 #include <SubscribeObj.h>
 
 int main(int argc, char *argv[])
@@ -12,7 +15,13 @@ int main(int argc, char *argv[])
 #endif
     QGuiApplication app(argc, argv);
 
+    // Declared first so that it outlives the engine whose QML reads it.
+    lilaomo::QmlMessageBridge bridge;
     QQmlApplicationEngine engine;
+    engine.rootContext()->setContextProperty(QStringLiteral("position"), bridge.Properties<PositionChange>({
+        { "x", &PositionChange::x },
+        { "y", &PositionChange::y }
+    }));
     const QUrl url(QStringLiteral("qrc:/main.qml"));
     QObject::connect(
         &engine,
@@ -24,6 +33,8 @@ int main(int argc, char *argv[])
         },
         Qt::QueuedConnection);
     engine.load(url);
+    if (!engine.rootObjects().isEmpty())
+        bridge.SetWindow(qobject_cast<QQuickWindow*>(engine.rootObjects().first()));
 
     SubscribeObj sobj;
     LLMMSG->Subscribe<PositionChange>(&SubscribeObj::NormalFunc, &sobj);
@@ -6,4 +6,13 @@ Window {
     height: 480
     visible: true
     title: qsTr("Hello World")
+
+    // Follows the latest PositionChange, updated at most once per frame.
+    Rectangle {
+        x: position.x || 0
+        y: position.y || 0
+        width: 20
+        height: 20
+        color: "steelblue"
+    }
 }